@@ -0,0 +1,457 @@
+/*
+ * rf_bridge_analyse.c
+ *
+ *  Created on: 17 Oct 2026
+ *
+ * Offline analyser for logic analyser captures (sigrok/pulseview VCD, like
+ * the ones in files/). The capture is mmap()ed and split in chunks at long
+ * silences, so no frame straddles two chunks; the chunks are then run in
+ * parallel through the firmware receiver model (fw_decode.c) and the
+ * frames are printed back in time order, followed by per protocol stats.
+ *
+ * rf_bridge_analyse [-j <threads>] [-s <silence ms>] [-c <channel>] [-q]
+ *		<capture.vcd> [<capture.vcd>...]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "msg.h"
+#include "decode.h"
+#include "fw_decode.h"
+#include "utils.h"
+
+/* matches.c wants this */
+const char *mqtt_root = "analyse";
+
+/* a frame needs at least that much silence to end in the firmware */
+#define SILENCE_MIN_MS	5
+
+typedef struct vcd_t {
+	const char *	fname;
+	const char *	base;
+	size_t			size;
+	const char *	data, * end;	// value changes
+	uint64_t		ps;				// timescale, in ps
+	char			id[16];			// of our channel
+	int				idlen;
+} vcd_t, *vcd_p;
+
+/* parser state, the chunks each have their own */
+typedef struct vcd_cursor_t {
+	const char *	cur, * end;
+	const char *	stamp;		// start of the last '#' timestamp
+	uint64_t		time;		// in ns
+} vcd_cursor_t, *vcd_cursor_p;
+
+typedef struct frame_t {
+	uint64_t		time;		// ns
+	char *			line;
+} frame_t;
+
+typedef struct chunk_t {
+	const char *	start, * end;
+	size_t			pulses;
+	int				count, size;
+	frame_t *		frame;
+} chunk_t, *chunk_p;
+
+typedef struct stats_t {
+	unsigned		frames, weather;
+	unsigned		bits_min, bits_max;
+	uint64_t		bits_total;
+	unsigned		clock_min, clock_max;
+	uint64_t		clock_total;
+} stats_t;
+
+static struct {
+	int				jobs;
+	uint64_t		silence;	// ns
+	const char *	channel;
+	int				quiet;
+} opt = {
+	.silence = 20 * 1000000ULL,
+};
+
+static const char *
+vcd_token(
+		const char ** cur,
+		const char * end,
+		int * len)
+{
+	const char * s = *cur;
+	while (s < end && isspace(*s))
+		s++;
+	const char * e = s;
+	while (e < end && !isspace(*e))
+		e++;
+	*cur = e;
+	*len = e - s;
+	return s < end ? s : NULL;
+}
+
+static int
+vcd_open(
+		vcd_p v,
+		const char * fname)
+{
+	memset(v, 0, sizeof(*v));
+	v->fname = fname;
+	int fd = open(fname, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(fname);
+		return -1;
+	}
+	v->size = st.st_size;
+	v->base = mmap(NULL, v->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (v->base == MAP_FAILED) {
+		perror(fname);
+		return -1;
+	}
+	madvise((void*)v->base, v->size, MADV_SEQUENTIAL);
+	v->ps = 1000;
+
+	/* header; all we want is the timescale and the channel id */
+	const char * cur = v->base, * end = v->base + v->size, * t;
+	int l;
+	while ((t = vcd_token(&cur, end, &l))) {
+		if (l == 10 && !strncmp(t, "$timescale", l)) {
+			char unit[8] = "";
+			unsigned n = 1;
+			t = vcd_token(&cur, end, &l);
+			if (!t)
+				break;
+			/* "1ns" or "1000 ns" */
+			char num[32];
+			snprintf(num, sizeof(num), "%.*s", l, t);
+			int c = 0;
+			sscanf(num, "%u%n", &n, &c);
+			if (num[c])
+				snprintf(unit, sizeof(unit), "%s", num + c);
+			else if ((t = vcd_token(&cur, end, &l)))
+				snprintf(unit, sizeof(unit), "%.*s", l, t);
+			uint64_t m = !strcmp(unit, "s") ? 1000000000000ULL :
+					!strcmp(unit, "ms") ? 1000000000ULL :
+					!strcmp(unit, "us") ? 1000000ULL :
+					!strcmp(unit, "ns") ? 1000ULL : 1;
+			v->ps = n * m;
+		} else if (l == 4 && !strncmp(t, "$var", l)) {
+			const char * type = vcd_token(&cur, end, &l);
+			const char * width = vcd_token(&cur, end, &l);
+			int wl = l;
+			const char * id = vcd_token(&cur, end, &l);
+			int il = l;
+			const char * name = vcd_token(&cur, end, &l);
+			if (!type || !width || !id || !name || v->idlen)
+				continue;
+			if (wl != 1 || *width != '1' || il >= sizeof(v->id))
+				continue;
+			if (opt.channel && (l != strlen(opt.channel) ||
+					strncmp(name, opt.channel, l)))
+				continue;
+			memcpy(v->id, id, il);
+			v->idlen = il;
+		} else if (l == 15 && !strncmp(t, "$enddefinitions", l)) {
+			vcd_token(&cur, end, &l);	// $end
+			v->data = cur;
+			v->end = end;
+			break;
+		}
+	}
+	if (!v->data || !v->idlen) {
+		fprintf(stderr, "%s: no %s channel found\n", fname,
+				opt.channel ? opt.channel : "1 bit");
+		munmap((void*)v->base, v->size);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Get the next value change of our channel, returns 0/1 or -1 at the
+ * end. 'x' and 'z' count as 0.
+ */
+static int
+vcd_next(
+		vcd_p v,
+		vcd_cursor_p c)
+{
+	const char * t;
+	int l;
+	while ((t = vcd_token(&c->cur, c->end, &l))) {
+		switch (*t) {
+			case '#':
+				c->stamp = t;
+				c->time = (strtoull(t + 1, NULL, 10) * v->ps) / 1000;
+				break;
+			case '0': case '1': case 'x': case 'X': case 'z': case 'Z':
+				if (l - 1 == v->idlen && !memcmp(t + 1, v->id, v->idlen))
+					return *t == '1';
+				break;
+			case 'b': case 'B': case 'r': case 'R':
+				vcd_token(&c->cur, c->end, &l);	// vector, skip it's id
+				break;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Find the first long silence after 'from', and return the start of the
+ * timestamp of the rising edge that ends it; or the end of the data.
+ */
+static const char *
+vcd_boundary(
+		vcd_p v,
+		const char * from)
+{
+	vcd_cursor_t c = { .cur = from, .end = v->end };
+	/* align on a timestamp */
+	while (c.cur < c.end && !(*c.cur == '#' && (c.cur == v->data ||
+			c.cur[-1] == '\n')))
+		c.cur++;
+	int val, last = -1;
+	uint64_t when = 0;
+	while ((val = vcd_next(v, &c)) >= 0) {
+		if (val == 1 && last == 0 && c.time - when >= opt.silence)
+			return c.stamp;
+		if (val != last)
+			when = c.time;
+		last = val;
+	}
+	return v->end;
+}
+
+static void
+chunk_frame(
+		fw_decoder_p d,
+		size_t start,
+		size_t end,
+		const char * line)
+{
+	chunk_p c = d->param;
+	if (c->count == c->size) {
+		c->size = c->size ? c->size * 2 : 64;
+		c->frame = realloc(c->frame, c->size * sizeof(c->frame[0]));
+	}
+	c->frame[c->count].time = start;	// pulse index, fixed up by the caller
+	c->frame[c->count].line = strdup(line);
+	c->count++;
+}
+
+static void
+chunk_decode(
+		vcd_p v,
+		chunk_p c)
+{
+	vcd_cursor_t cur = { .cur = c->start, .end = c->end };
+	fw_sampler_t s;
+	int val, started = 0;
+
+	while ((val = vcd_next(v, &cur)) >= 0) {
+		if (!started) {
+			fw_sampler_init(&s, cur.time);
+			started = 1;
+		}
+		fw_sampler_edge(&s, cur.time, val);
+	}
+	if (!started)
+		return;
+	fw_sampler_flush(&s);
+
+	fw_decoder_t d = {
+		.pulse = (const fw_pulse_t *)s.pulse,
+		.count = s.count,
+		.frame = chunk_frame,
+		.param = c,
+	};
+	fw_decode(&d);
+	for (int i = 0; i < c->count; i++)
+		c->frame[i].time = s.stamp[c->frame[i].time];
+	c->pulses = s.count;
+	fw_sampler_free(&s);
+}
+
+/* work shared by the threads; they pick the next item as they go */
+static struct {
+	vcd_p			v;
+	const char **	from;		// boundary search start, or NULL
+	const char **	boundary;
+	chunk_p			chunk;
+	int				count;
+	int				next;
+} work;
+
+static void *
+worker(
+		void * param)
+{
+	int i;
+	while ((i = __sync_fetch_and_add(&work.next, 1)) < work.count) {
+		if (work.from)
+			work.boundary[i] = vcd_boundary(work.v, work.from[i]);
+		else
+			chunk_decode(work.v, &work.chunk[i]);
+	}
+	return NULL;
+}
+
+static void
+run_workers()
+{
+	pthread_t t[opt.jobs];
+	work.next = 0;
+	for (int i = 0; i < opt.jobs; i++)
+		pthread_create(&t[i], NULL, worker, NULL);
+	for (int i = 0; i < opt.jobs; i++)
+		pthread_join(t[i], NULL);
+}
+
+static void
+stats_add(
+		stats_t * st,
+		msg_p m)
+{
+	if (!st->frames || m->bitcount < st->bits_min)
+		st->bits_min = m->bitcount;
+	if (m->bitcount > st->bits_max)
+		st->bits_max = m->bitcount;
+	if (!st->frames || m->pulse_duration < st->clock_min)
+		st->clock_min = m->pulse_duration;
+	if (m->pulse_duration > st->clock_max)
+		st->clock_max = m->pulse_duration;
+	st->bits_total += m->bitcount;
+	st->clock_total += m->pulse_duration;
+	st->frames++;
+}
+
+static int
+analyse(
+		const char * fname)
+{
+	vcd_t v;
+	if (vcd_open(&v, fname))
+		return -1;
+	uint64_t start = gettime_us();
+
+	/* split in (many more) ranges than threads, and find the silences */
+	size_t len = v.end - v.data;
+	int ranges = opt.jobs * 8;
+	if (len / ranges < 4096)
+		ranges = len / 4096 + 1;
+	const char * from[ranges], * boundary[ranges];
+	for (int i = 0; i < ranges; i++)
+		from[i] = v.data + (len * i / ranges);
+	work = (typeof(work)) { .v = &v, .from = from, .boundary = boundary,
+			.count = ranges };
+	run_workers();
+
+	chunk_t chunk[ranges];
+	int count = 0;
+	const char * last = v.data;
+	for (int i = 0; i < ranges; i++) {
+		const char * b = i ? boundary[i] : v.data;
+		if (i && b <= last)
+			continue;
+		if (count)
+			chunk[count - 1].end = b;
+		chunk[count++] = (chunk_t) { .start = b, .end = v.end };
+		last = b;
+	}
+	if (count && chunk[count - 1].start == v.end)
+		count--;
+	work = (typeof(work)) { .v = &v, .chunk = chunk, .count = count };
+	run_workers();
+
+	/* chunks are in time order, and so are their frames */
+	stats_t stats[128] = {};
+	size_t pulses = 0;
+	unsigned frames = 0;
+	msg_full_t u;
+	for (int i = 0; i < count; i++) {
+		chunk_p c = &chunk[i];
+		pulses += c->pulses;
+		for (int f = 0; f < c->count; f++) {
+			frame_t * fr = &c->frame[f];
+			frames++;
+			if (!opt.quiet)
+				printf("%12.6f %s\n", fr->time / 1e9, fr->line);
+			if (msg_parse(&u.m, 256 / 8, fr->line) == 0) {
+				stats_t * st = &stats[u.m.type & 0x7f];
+				stats_add(st, &u.m);
+				weather_t w;
+				if (!weather_find(&u.m) && !weather_decode(&u.m, &w))
+					st->weather++;
+			}
+			free(fr->line);
+		}
+		free(c->frame);
+	}
+	uint64_t us = gettime_us() - start;
+
+	printf("# %s: %.1fMB, %d chunks, %d threads, %zu pulses, %u frames, "
+			"%.1fms (%.1fMB/s)\n",
+			fname, v.size / 1e6, count, opt.jobs, pulses, frames,
+			us / 1e3, us ? (v.size / (double)us) : 0);
+	printf("# type\tframes\tbits min/avg/max\tclock min/avg/max\tweather\n");
+	for (int t = 0; t < 128; t++) {
+		stats_t * st = &stats[t];
+		if (!st->frames)
+			continue;
+		printf("# M%c\t%u\t%u/%u/%u\t%02x/%02x/%02x\t%u\n", t, st->frames,
+				st->bits_min, (unsigned)(st->bits_total / st->frames),
+				st->bits_max,
+				st->clock_min, (unsigned)(st->clock_total / st->frames),
+				st->clock_max, st->weather);
+	}
+	munmap((void*)v.base, v.size);
+	return 0;
+}
+
+int
+main(
+		int argc,
+		const char * argv[])
+{
+	int res = 0, files = 0;
+
+	opt.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-j") && i < argc - 1)
+			opt.jobs = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-s") && i < argc - 1)
+			opt.silence = atoi(argv[++i]) * 1000000ULL;
+		else if (!strcmp(argv[i], "-c") && i < argc - 1)
+			opt.channel = argv[++i];
+		else if (!strcmp(argv[i], "-q"))
+			opt.quiet = 1;
+		else if (argv[i][0] == '-') {
+			fprintf(stderr, "%s: [-j <threads>] [-s <silence ms>] "
+					"[-c <channel>] [-q] <capture.vcd>...\n", argv[0]);
+			exit(1);
+		} else {
+			files++;
+			if (opt.jobs < 1)
+				opt.jobs = 1;
+			if (opt.silence < SILENCE_MIN_MS * 1000000ULL)
+				opt.silence = SILENCE_MIN_MS * 1000000ULL;
+			res |= analyse(argv[i]);
+		}
+	}
+	if (!files) {
+		fprintf(stderr, "%s: no capture file\n", argv[0]);
+		exit(1);
+	}
+	return res ? 1 : 0;
+}
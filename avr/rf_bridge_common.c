@@ -47,10 +47,9 @@
 #include "rf_bridge_common.h"
 
 #define STACK_DEBUG
+#define SELFTEST
 
-#ifdef STACK_DEBUG
 #include <string.h> // memset
-#endif
 
 #define ARRAY_SIZE(xx) (sizeof(xx)/sizeof(xx[0]))
 
@@ -68,6 +67,8 @@ enum {
 	state_Decoding_ASK,
 	state_Decoding_OOK,
 	state_Decoding_Manchester,
+	state_Decoding_Fixed,		// PT2262/EV1527 style PWM
+	state_Decoding_Distance,	// pulse distance
 	state_DecodeRawPulses,
 	state_DecodeDone,
 	state_ReceivingCommand,
@@ -76,23 +77,56 @@ volatile uint8_t	running_state = state_SyncSearch;
 
 /* Flag: Are we displaying raw pulses, or already decoded messages */
 struct {
-	uint8_t display_pulses: 1, display_stacks: 1;
+	uint8_t display_pulses: 1, pack_pulses: 1, display_stacks: 1;
 } flags = {
 	.display_pulses = 0,
 };
 
 volatile uint8_t tickcount = 0;
 
+/*
+ * The mega has the RAM for frames longer than 255 bits; bit counts and
+ * the transmit indexes are 16 bits there, and the bit count of the long
+ * frames is sent as '&xxxx' instead of '#xx'.
+ */
+#ifdef M2560
+#define LONG_FRAMES
+typedef uint16_t bcount_t;
+#define TX_PULSES	1024
+#else
+typedef uint8_t bcount_t;
+#define TX_PULSES	256
+#endif
+
 /*
  * everything is pretty much geared to use uint8_t integer overflow
  * naturally, without having to worry about boundaries etc, so the pulse
  * count buffer is more or less fixed at that size, and everything else
  * like cursors will also use the same 8 bits overflows.
+ * The receiver only ever uses the first 256; transmit can use it all.
  */
-volatile uint8_t pulse[256][2];		// circular buffer of pulse durations
+volatile uint8_t pulse[TX_PULSES][2];	// circular buffer of pulse durations
 volatile uint8_t current_pulse = 0;	// current 'filling' cursor
 volatile uint8_t msg_start = 0,
 				msg_end = 0;			// markers for the decoders
+volatile bcount_t tx_pulse, tx_end;		// same, for the transmitter
+
+/*
+ * Packed pulses ('MQ'), both ways; every phase is 2 bits, an index in a
+ * table of up to PACK_TABLE durations, or PACK_ESCAPE followed by the 8
+ * bits duration, which then goes in the table if there is room. The table
+ * starts empty with every frame, and the last byte is padded with ones.
+ * A packed frame to transmit stays packed in the pulse buffer, the TX
+ * interrupt unpacks the pulses as it goes.
+ */
+#define PACK_TABLE		3
+#define PACK_ESCAPE		3
+static struct {
+	uint8_t		packed : 1;
+	uint8_t		table[PACK_TABLE], used;
+	uint16_t	bit;		// next one to unpack
+} tx_pack;
+volatile uint16_t tx_gap;	// ticks of silence after the frame
 
 /*
  * Transceiver state; we are half duplex, can't receive and transmit, as
@@ -102,18 +136,69 @@ volatile uint8_t msg_start = 0,
 enum {
 	mode_Idle = 0,
 	mode_Receiving,
+	mode_Listening,		// listen before talk
 	mode_StartTransmit,
 	mode_Transmitting,
+	mode_Gap,			// silence after a frame we sent
+	mode_SelfTest,		// the decoders get synthesised frames
 };
 volatile uint8_t transceiver_mode = mode_Receiving;
 
 const uint8_t timer_mask = (1 << OCIE0A) | (1 << OCIE0B);
 
+/*
+ * Receiver ISR state, in a GPIOR so it's in sbi/cbi/sbic reach
+ */
+#define RX_STATE		GPIOR0
+#define RX_BIT			0		// previous sample
+#define RX_SLOW_BIT		1		// timer at 1/RX_SLOW of the rate
+
+/*
+ * Two speed receiver; when nothing was heard for a while, the timer runs
+ * RX_SLOW times slower, and the receiver ISR counts RX_SLOW per tick, so
+ * the durations (and tickcount) stay the same, just coarser. The first
+ * real pulse switches back to the full rate, long before the sync search
+ * has seen enough of them. The transmitter always gets the full rate.
+ */
+#define TIMER_TOP		(0x3d / 2)	// as set by main(), 64 ticks per ms
+#define RX_SLOW			4
+uint8_t rx_idle_ms = 200;	// 0 disables the slow rate
+
+static inline void rx_set_speed(uint8_t slow)
+{
+	if (!!(RX_STATE & (1 << RX_SLOW_BIT)) == slow)
+		return;
+	cli();
+	OCR0A = OCR0B = slow ? ((TIMER_TOP + 1) * RX_SLOW) - 1 : TIMER_TOP;
+	TCNT0 = 0;
+	if (slow)
+		RX_STATE |= (1 << RX_SLOW_BIT);
+	else
+		RX_STATE &= ~(1 << RX_SLOW_BIT);
+	sei();
+}
+
+#ifdef PIN_TRANSMITTER_OC4B
+static void tx_hw_start();
+
+/* stop timer 4, the transmitter pin is back to PORTH, which is low */
+static inline void tx_hw_stop()
+{
+	TIMSK4 = 0;
+	TCCR4B = 0;
+	TCCR4A = 0;
+}
+#endif
+
 static inline void disable_transceiver()
 {
+	rx_set_speed(0);
 	transceiver_mode = mode_Idle;
 	pin_clr(pin_Antenna);
 	TIMSK0 &= ~timer_mask;
+#ifdef PIN_TRANSMITTER_OC4B
+	tx_hw_stop();
+#endif
 }
 
 static inline void enable_receiver()
@@ -126,53 +211,333 @@ static inline void enable_receiver()
 	TIMSK0 |= (1 << OCIE0A);
 }
 
+/* Uses the TX timer interrupt to watch the receiver, without touching
+ * the pulse buffer that holds the frame we want to send */
+static inline void enable_listener()
+{
+	rx_set_speed(0);
+	TIMSK0 &= ~timer_mask;
+	pin_clr(pin_Antenna);
+	transceiver_mode = mode_Listening;
+	TIMSK0 |= (1 << OCIE0B);
+}
+
+/* The TX timer interrupt does nothing then, but wakes the main loop */
+static inline void enable_selftest()
+{
+	rx_set_speed(0);
+	TIMSK0 &= ~timer_mask;
+	pin_clr(pin_Antenna);
+	transceiver_mode = mode_SelfTest;
+	TIMSK0 |= (1 << OCIE0B);
+}
+
 static inline void enable_transmitter()
 {
+	rx_set_speed(0);
+#ifdef PIN_TRANSMITTER_OC4B
+	if (TIMSK4 & (1 << OCIE4B))
+		return;
+	TIMSK0 &= ~((1 << OCIE0A) | (1 << OCIE0B));
+	pin_set(pin_Antenna);
+	tx_hw_start();
+#else
 	if ((TIMSK0 & timer_mask) == (1 << OCIE0B))
 		return;
 	TIMSK0 &= ~((1 << OCIE0A) | (1 << OCIE0B));
 	pin_set(pin_Antenna);
 	transceiver_mode = mode_StartTransmit;
 	TIMSK0 |= (1 << OCIE0B);
+#endif
 }
 
 #define MAX_TICKS_PER_PHASE 255
+#define TICKS_PER_MS		64		// 16Mhz / 8 / 31
+
+/*
+ * Listen before talk; number of 'real' pulses seen while listening,
+ * noise glitches are ignored like the receive ISR does.
+ */
+volatile uint8_t listen_activity = 0;
+#define LBT_MIN_PULSE		20
+#define LBT_MAX_WAIT		(500 * TICKS_PER_MS)
+uint8_t lbt_idle_ms = 10;	// 0 disables it
+
+/*
+ * Band statistics, since the last STATS command. They are kept by the
+ * main loop trailing the receiver, the ISR doesn't do any extra work.
+ */
+#define STATS_BUCKETS		8	// of 64 ticks (1ms) pulse durations
+struct {
+	uint8_t		pi;				// trails current_pulse
+	uint16_t	pulses, idle;	// all of them, and while looking for a sync
+	uint32_t	busy;			// ticks in pulses, not counting silences
+	uint16_t	syncs, fails, frames;
+	uint16_t	hist[STATS_BUCKETS];
+} stats;
 
 /*
  * This is the 'sensitive' part here. Nothing fancy, everything needs
  * to be quick as the frequency of the timer is quite high; so in receive
  * mode we just do some filtered edge detection (cheaply).
+ * The previous sample lives in a GPIOR bit (sbi/cbi/sbic), and the ISR
+ * works on 'rx_slot', the pulse current_pulse is at, so there is no
+ * indexing to do on every tick. Both only change on a rising edge, or
+ * in rx_reset().
+ * It's split out of the ISR so the self test can feed it samples too.
  */
-ISR(TIMER0_COMPA_vect)	// handler for Output Compare 0 overflow interrupt
-{
-	static uint8_t bit = 0;			// bool
-	static uint8_t b;
+#define RX_MIN_PHASE	20		// shorter pulses are glitches
+
+static volatile uint8_t * rx_slot = pulse[0];
 
-	b = pin_get(pin_Receiver);
+static inline void rx_reset()
+{
+	cli();
+	current_pulse = 0;
+	rx_slot = pulse[0];
+	sei();
+}
 
+static inline __attribute__((always_inline)) void rx_sample(uint8_t b)
+{
+	volatile uint8_t * p = rx_slot;
+	uint8_t step = RX_STATE & (1 << RX_SLOW_BIT) ? RX_SLOW : 1;
 	/* increment the pulse count for the phase (bit) we are in */
-	if (pulse[current_pulse][b] < MAX_TICKS_PER_PHASE)
-		pulse[current_pulse][b]++;
+	if (p[b] <= MAX_TICKS_PER_PHASE - step)
+		p[b] += step;
+	else
+		p[b] = MAX_TICKS_PER_PHASE;
 	/* if raising edge, switch pulse counter to the next one */
-	if (!bit && b) {
+	if (!(RX_STATE & (1 << RX_BIT)) && b) {
 #if defined(SIMAVR) && defined(M2560)
-			D(SPCR = pulse[current_pulse][0]);
+			D(SPCR = p[0]);
 #endif
 		/* if tiny pulse, just ignore it */
-		if (pulse[current_pulse][0] > 20 || pulse[current_pulse][1] > 20)
+		if (p[0] > RX_MIN_PHASE || p[1] > RX_MIN_PHASE) {
 			current_pulse++;
-		pulse[current_pulse][0] = pulse[current_pulse][1] = 0;
+			p = rx_slot = pulse[current_pulse];
+		}
+		p[0] = p[1] = 0;
 	}
 #if defined(SIMAVR) && defined(M2560)
-	else if (bit && !b) {
-			D(SPCR = pulse[current_pulse][1];)
+	else if ((RX_STATE & (1 << RX_BIT)) && !b) {
+			D(SPCR = p[1];)
 	}
 	D(SPSR = current_pulse;)
 #endif
-	bit = b;
-//	D(pin_set_to(pin_Debug0, bit);)
+	if (b)
+		RX_STATE |= (1 << RX_BIT);
+	else
+		RX_STATE &= ~(1 << RX_BIT);
+//	D(pin_set_to(pin_Debug0, b);)
+}
 
-	tickcount++;
+#ifdef PIN_RECEIVER_IO
+/*
+ * Same as rx_sample(), by hand. It only needs 4 registers, and doesn't
+ * touch r0/r1 so there is no need to save and clear them. Around 65
+ * cycles per tick, including the interrupt response and the reti, vs
+ * more than 100 for the C version.
+ * The phases saturating at 255 relies on 'inc' being the compare, and on
+ * the carry of the 'subi' (a borrow unless it wraps) at the slow rate.
+ */
+#if MAX_TICKS_PER_PHASE != 255
+#error The receiver ISR assumes the phases saturate at 255
+#endif
+ISR(TIMER0_COMPA_vect, ISR_NAKED)
+{
+	asm volatile (
+		"push	r24\n"
+		"in		r24, __SREG__\n"
+		"push	r24\n"
+		"push	r25\n"
+		"push	r30\n"
+		"push	r31\n"
+		/* r25 = pin_get(pin_Receiver) */
+		"ldi	r25, 0\n"
+		"sbic	%[pin], %[bit]\n"
+		"ldi	r25, 1\n"
+		/* Z = &rx_slot[b] */
+		"lds	r30, %[slot]\n"
+		"lds	r31, %[slot]+1\n"
+		"sbrc	r25, 0\n"
+		"adiw	r30, 1\n"
+		"ld		r24, Z\n"
+		"sbic	%[state], %[slow]\n"
+		"rjmp	6f\n"
+		"inc	r24\n"
+		"breq	1f\n"
+		"st		Z, r24\n"
+		"rjmp	1f\n"
+	"6:\n"
+		"subi	r24, lo8(-%[step])\n"
+		"brcs	7f\n"
+		"ldi	r24, 255\n"
+	"7:\n"
+		"st		Z, r24\n"
+	"1:\n"
+		"sbrs	r25, 0\n"
+		"rjmp	3f\n"
+		"sbic	%[state], %[rx]\n"
+		"rjmp	5f\n"
+		/* rising edge; Z is at the high phase */
+		"sbiw	r30, 1\n"
+		"ld		r24, Z\n"
+		"cpi	r24, %[min] + 1\n"
+		"brsh	2f\n"
+		"ldd	r24, Z+1\n"
+		"cpi	r24, %[min] + 1\n"
+		"brlo	4f\n"
+	"2:\n"
+		"lds	r24, %[current]\n"
+		"inc	r24\n"
+		"sts	%[current], r24\n"
+		"adiw	r30, 2\n"
+		"tst	r24\n"
+		"brne	4f\n"
+		"ldi	r30, lo8(%[pulse])\n"
+		"ldi	r31, hi8(%[pulse])\n"
+	"4:\n"
+		"ldi	r24, 0\n"
+		"st		Z, r24\n"
+		"std	Z+1, r24\n"
+		"sts	%[slot], r30\n"
+		"sts	%[slot]+1, r31\n"
+		"sbi	%[state], %[rx]\n"
+		"rjmp	5f\n"
+	"3:\n"
+		"cbi	%[state], %[rx]\n"
+	"5:\n"
+		"lds	r24, %[tick]\n"
+		"inc	r24\n"
+		"sbic	%[state], %[slow]\n"
+		"subi	r24, lo8(-(%[step] - 1))\n"
+		"sts	%[tick], r24\n"
+		"pop	r31\n"
+		"pop	r30\n"
+		"pop	r25\n"
+		"pop	r24\n"
+		"out	__SREG__, r24\n"
+		"pop	r24\n"
+		"reti\n"
+		:
+		: [pin] "I" (_SFR_IO_ADDR(__PIN(pin_Receiver))),
+		  [bit] "I" (_pins[pin_Receiver].pin),
+		  [state] "I" (_SFR_IO_ADDR(RX_STATE)),
+		  [rx] "I" (RX_BIT),
+		  [slow] "I" (RX_SLOW_BIT),
+		  [step] "M" (RX_SLOW),
+		  [min] "M" (RX_MIN_PHASE),
+		  [slot] "i" (&rx_slot),
+		  [current] "i" (&current_pulse),
+		  [pulse] "i" (pulse),
+		  [tick] "i" (&tickcount)
+	);
+}
+
+/*
+ * Build time check that the receiver pin is in reach of sbic/sbis, like
+ * pin_get() would compile to. The call is only left in (and fails the
+ * build) if it isn't, or if the address doesn't fold to a constant.
+ */
+extern void rx_pin_not_in_io_space()
+		__attribute__((error("pin_Receiver can't be read with sbic")));
+
+static inline void rx_pin_check()
+{
+	if (_SFR_IO_ADDR(__PIN(pin_Receiver)) > 0x1f)
+		rx_pin_not_in_io_space();
+}
+#else
+/* the mega receiver pin (PH5) is out of the I/O space, C it is */
+ISR(TIMER0_COMPA_vect)	// handler for Output Compare 0 overflow interrupt
+{
+	rx_sample(pin_get(pin_Receiver));
+	tickcount += RX_STATE & (1 << RX_SLOW_BIT) ? RX_SLOW : 1;
+}
+
+static inline void rx_pin_check()
+{
+}
+#endif
+
+/* next 'n' bits of the packed frame */
+static inline uint8_t tx_unpack_bits(uint8_t n)
+{
+	const volatile uint8_t * s = (volatile uint8_t *)pulse + (tx_pack.bit / 8);
+	uint16_t w = (s[0] << 8) | s[1];
+
+	w >>= 16 - n - (tx_pack.bit % 8);
+	tx_pack.bit += n;
+	return w & ((1 << n) - 1);
+}
+
+static inline uint8_t tx_unpack_phase()
+{
+	uint8_t d = tx_unpack_bits(2);
+
+	if (d != PACK_ESCAPE)
+		return tx_pack.table[d];
+	d = tx_unpack_bits(8);
+	if (d < MAX_TICKS_PER_PHASE && tx_pack.used < PACK_TABLE)
+		tx_pack.table[tx_pack.used++] = d;
+	return d;
+}
+
+/*
+ * Walk a packed frame of 'bytes' once before it is sent, the interrupt
+ * trusts it; returns 0 if exactly 'count' pulses are in there, with every
+ * index in the table by the time it's used.
+ */
+static uint8_t
+tx_pack_check(
+		uint16_t bytes,
+		bcount_t count)
+{
+	uint16_t bits = bytes * 8;
+	uint8_t res = 0;
+
+	tx_pack.bit = tx_pack.used = 0;
+	for (bcount_t i = 0; i < count && !res; i++) {
+		for (uint8_t ph = 0; ph < 2 && !res; ph++) {
+			if (tx_pack.bit + 2 > bits) {
+				res = 1;
+				break;
+			}
+			uint8_t d = tx_unpack_bits(2);
+			if (d != PACK_ESCAPE) {
+				res = d >= tx_pack.used;
+				continue;
+			}
+			tx_pack.bit -= 2;
+			if (tx_pack.bit + 10 > bits)
+				res = 1;
+			else
+				tx_unpack_phase();
+		}
+	}
+	/*
+	 * The last byte is padded with ones, that can't be another pulse,
+	 * and there is nothing after it
+	 */
+	if (!res) {
+		uint16_t pad = bits - tx_pack.bit;
+		res = pad >= 8 || (pad && tx_unpack_bits(pad) != (1 << pad) - 1);
+	}
+	tx_pack.bit = tx_pack.used = 0;
+	return res;
+}
+
+/* load pulse 'tx_pulse' in 'tp' */
+static inline void tx_next(uint8_t * tp)
+{
+	if (tx_pack.packed) {
+		tp[1] = tx_unpack_phase();
+		tp[0] = tx_unpack_phase();
+	} else {
+		tp[0] = pulse[tx_pulse][0];
+		tp[1] = pulse[tx_pulse][1];
+	}
 }
 
 /*
@@ -193,30 +558,138 @@ ISR(TIMER0_COMPB_vect)	// handler for Output Compare 1 overflow interrupt
 				break;
 			bit = !bit;
 			if (bit) {
-				current_pulse++;
-				tp[0] = pulse[current_pulse][0];
-				tp[1] = pulse[current_pulse][1];
-				if (current_pulse == msg_end) {
-					transceiver_mode = mode_Idle;
+				if (++tx_pulse == tx_end) {
+					transceiver_mode = tx_gap ? mode_Gap : mode_Idle;
 					bit = 0; // we're done, return to 0
-				} else
+				} else {
+					tx_next(tp);
 					bit = !!tp[1]; // hande case when new phase(1) is zero
+				}
 			}
 			pin_set_to(pin_Transmitter, bit);
 		}	break;
+		case mode_Gap: {
+			if (!--tx_gap)
+				transceiver_mode = mode_Idle;
+		}	break;
 		case mode_StartTransmit: {
 			bit = 1;	// start phase is one.
 			transceiver_mode = mode_Transmitting;
-			current_pulse = msg_start;
-			tp[0] = pulse[current_pulse][0];
-			tp[1] = pulse[current_pulse][1];
+			tx_pulse = 0;
+			tx_pack.bit = tx_pack.used = 0;
+			tx_next(tp);
 			pin_set_to(pin_Transmitter, 1);
 		}	break;
+		case mode_Listening: {
+			uint8_t b = pin_get(pin_Receiver);
+			if (b == bit) {
+				if (tp[0] < MAX_TICKS_PER_PHASE)
+					tp[0]++;
+			} else {
+				if (tp[0] > LBT_MIN_PULSE)
+					listen_activity++;
+				tp[0] = 0;
+				bit = b;
+			}
+		}	break;
 	}
 
 	tickcount++;
 }
 
+#ifdef PIN_TRANSMITTER_OC4B
+/*
+ * Hardware transmitter; timer 4 runs at the same clock as timer 0, and
+ * the output compare sets or clears the pin, so the edges are exact
+ * whatever the other interrupts are doing. The interrupt only runs once
+ * per edge, to program the next one, timer 0 is off meanwhile.
+ * Empty phases are merged with the ones around them, so there is no
+ * edge to make there.
+ */
+#define TX_HW_TICK		(TIMER_TOP + 1u)	// timer 4 counts per tick
+/* longest merged phase, so the compare stays in 16 bits */
+#define TX_HW_MAX		(0xffff / TX_HW_TICK)
+
+static struct {
+	uint8_t		tp[2];		// current pulse
+	uint8_t		ph : 1,		// phase we're in, 1 for high (tp[1])
+				end : 1;	// the compare programmed ends the frame
+	uint16_t	next;		// ticks of the phase after
+} txh;
+
+/* ticks of the next phase, -1 at the end of the frame */
+static inline int16_t tx_hw_phase()
+{
+	if (txh.ph) {
+		txh.ph = 0;
+		return txh.tp[0];
+	}
+	if (++tx_pulse == tx_end)
+		return -1;
+	tx_next(txh.tp);
+	txh.ph = 1;
+	return txh.tp[1];
+}
+
+/* the pin is in a phase of 'd' ticks, program the compare that ends it */
+static inline void tx_hw_schedule(uint16_t d)
+{
+	uint8_t level = txh.ph;
+	int16_t n;
+
+	while ((n = tx_hw_phase()) == 0) {
+		/* nothing in between, that's the same phase going on */
+		if ((n = tx_hw_phase()) < 0)
+			break;
+		d += n;
+	}
+	if (d > TX_HW_MAX)
+		d = TX_HW_MAX;
+	OCR4B += d * TX_HW_TICK;
+	txh.end = n < 0;
+	txh.next = n;
+	/* set on the compare if the next phase is high, clear otherwise */
+	if (!txh.end && !level)
+		TCCR4A = (1 << COM4B1) | (1 << COM4B0);
+	else
+		TCCR4A = (1 << COM4B1);
+}
+
+static void tx_hw_start()
+{
+	transceiver_mode = mode_Transmitting;
+	tx_pulse = 0;
+	tx_pack.bit = tx_pack.used = 0;
+	tx_next(txh.tp);
+	txh.ph = 1;
+	TCCR4B = 0;
+	TCNT4 = 0;
+	OCR4B = 0;
+	/* start phase is one, right now */
+	TCCR4A = (1 << COM4B1) | (1 << COM4B0);
+	TCCR4C = (1 << FOC4B);
+	tx_hw_schedule(txh.tp[1]);
+	TIFR4 = (1 << OCF4B);
+	TIMSK4 = (1 << OCIE4B);
+	TCCR4B = (1 << CS41);	// clk/8, like timer 0
+}
+
+ISR(TIMER4_COMPB_vect)
+{
+	if (!txh.end) {
+		tx_hw_schedule(txh.next);
+		return;
+	}
+	tx_hw_stop();
+	if (tx_gap) {
+		/* timer 0 counts that one down */
+		transceiver_mode = mode_Gap;
+		TIMSK0 |= (1 << OCIE0B);
+	} else
+		transceiver_mode = mode_Idle;
+}
+#endif
+
 // absolute value substraction for durations etc
 static uint8_t abs_sub(uint8_t v1, uint8_t v2) {
 	return v1 > v2? v1 - v2 : v2 - v1;
@@ -229,10 +702,57 @@ uint8_t ovf_sub(uint8_t v1, uint8_t v2) {
 /* used by the syncsearch, and used by the manchester decoder too */
 uint8_t syncduration = 0;
 uint8_t chk = 0, byte = 0;
-uint8_t bcount = 0;
+bcount_t bcount = 0;
 uint8_t msg_type = 'P';
 uint8_t decoded = 0;		// ask is tried first, and validates
 
+#ifdef SELFTEST
+/*
+ * Loopback self test; 'TEST' synthesises frames and feeds them, a phase
+ * at a time, to the same sampling code the receiver ISR runs, so they go
+ * through the sync search and the decoders like the real thing. It sweeps
+ * the bit period and the jitter, and counts the frames that came out right.
+ * The frame types are:
+ *	'E'	24 bits PWM, for the fixed code decoder
+ *	'A'	72 bits PWM, too long for that one, so ASK (or OOK, when slow)
+ *	'M'	32 bits manchester, with SELFTEST_PREAMBLE zeroes before
+ * The random generator always starts the same, so the results can be
+ * compared from one firmware to the next.
+ */
+#define SELFTEST_FRAMES		4	// per point
+#define SELFTEST_JITTERS	6	// +-0 to 5/64th of the bit period
+#define SELFTEST_PERIOD		24	// first bit period, and the step, in ticks
+#define SELFTEST_PERIODS	10
+#define SELFTEST_PREAMBLE	16
+#define SELFTEST_TAIL		2	// zero bits after the manchester payload
+#define SELFTEST_SETTLE		32	// main loop rounds the decoders get
+struct {
+	uint8_t		type;		// of the frames, 0 when not running
+	uint8_t		period;		// bit period, in ticks
+	uint8_t		jitter;		// in 1/64th of the period
+	uint8_t		frame;		// in that point
+	uint8_t		bits, lead;	// payload, and zeroes the decoder outputs first
+	uint8_t		bit, phase;	// next to send
+	uint8_t		settle;
+	uint8_t		rnd;
+	uint8_t		bad, good;	// for the frame being decoded
+	uint8_t		display_pulses;
+	uint8_t		data[9];
+	uint8_t		ok[SELFTEST_JITTERS];
+	uint16_t	syncs, fails;	// the test isn't band traffic
+	FILE *		out;
+} selftest;
+
+/* the 'i'th bit the decoder should output */
+static uint8_t selftest_bit(bcount_t i)
+{
+	if (i < selftest.lead)
+		return 0;
+	i -= selftest.lead;
+	return (selftest.data[i / 8] >> (7 - (i % 8))) & 1;
+}
+#endif
+
 /*
  * stuff the next bit in the 8 bits buffer, and output it when full.
  * With enough memory, we could use a much larger buffer and do the print
@@ -241,6 +761,11 @@ uint8_t decoded = 0;		// ask is tried first, and validates
  */
 static void stuffbit(uint8_t b, uint8_t last) {
 	uint8_t bn = bcount % 8;
+#ifdef SELFTEST
+	if (selftest.type && bcount < selftest.lead + selftest.bits &&
+			b != selftest_bit(bcount))
+		selftest.bad = 1;
+#endif
 	byte |= b << (7 - bn);
 	bcount++;
 	if (last || bn == 7) {
@@ -250,12 +775,51 @@ static void stuffbit(uint8_t b, uint8_t last) {
 	}
 }
 
+/*
+ * Bits whose timing was out of tolerance, the decoders guessed; they are
+ * sent after the payload as '?<bit index>', so the host can try the other
+ * value. More than ERASE_MAX of them is sent as '?ff', hopeless.
+ * They are not part of the checksum.
+ */
+#define ERASE_MAX	6
+uint8_t erase[ERASE_MAX];
+uint8_t erased = 0;
+
+static void erasebit() {
+#ifdef LONG_FRAMES
+	/* the indexes are 8 bits, can't tell which one it was; hopeless */
+	if (bcount > 0xff) {
+		erased = ERASE_MAX + 1;
+		return;
+	}
+#endif
+	if (erased < ERASE_MAX)
+		erase[erased] = bcount;
+	if (erased <= ERASE_MAX)
+		erased++;
+}
+
 #define SYNC_LEN 8
 
+/* the decoder to try for a sync of equal pulses */
+static uint8_t sync_decoder(uint8_t pwm, uint8_t manchester)
+{
+	if (pwm >= SYNC_LEN - 1)
+		return state_Decoding_Fixed;
+	if (syncduration > 0x80)
+		return state_Decoding_OOK;
+	if (manchester > 4)
+		return state_Decoding_Manchester;
+	return state_Decoding_ASK;
+}
+
 /*
  * Search for 8 pulses of ~equal duration. Even manchester starts with
  * at least 8 of them like that, while ASK will always be at least
- * 8 bits anyway, so it's a good discriminant
+ * 8 bits anyway, so it's a good discriminant.
+ * Pulse distance frames don't have that, their pulses are a constant
+ * mark and a space of two lengths; that is tracked on the side, and
+ * also makes a sync.
  */
 AVR_CR(cr_syncsearch)
 {
@@ -263,20 +827,42 @@ AVR_CR(cr_syncsearch)
 	uint8_t syncstart = 0;
 	uint8_t synclen = 0;
 	uint8_t manchester = 0;
+	uint8_t pwm = 0;			// pulses with a 1:2 to 1:5 phase ratio
+	uint8_t markstart = 0;
+	uint8_t marks = 0, mark = 0;
+	uint8_t space_lo = 0, space_hi = 0;
 	do {
 		while (pi == current_pulse || running_state != state_SyncSearch) {
 			if (running_state == state_SyncSearch) {
 				if (synclen == 0) {
-					if (!uart_rx_isempty(&uart_rx))
+					if (uart_rx_ready())
 						running_state = state_ReceivingCommand;
 				}
 			}
 			cr_yield(0);
 		}
-		while (pi != current_pulse && synclen < SYNC_LEN) {
+		uint8_t spaced = 0;
+		while (pi != current_pulse && synclen < SYNC_LEN && !spaced) {
 			uint8_t p0 = pulse[pi][0], p1 = pulse[pi][1];
 			uint16_t d = p0 + p1;
 
+			uint8_t dist = p1 >= 0x10 && p0 < MAX_TICKS_PER_PHASE &&
+					p0 >= p1 - (p1 / 4);
+			if (dist && abs_sub(p1, mark) <= (mark / 8)) {
+				if (p0 < space_lo)
+					space_lo = p0;
+				if (p0 > space_hi)
+					space_hi = p0;
+				marks++;
+				spaced = marks >= SYNC_LEN &&
+							space_hi > space_lo + (space_lo / 2);
+			} else {
+				markstart = pi;
+				mark = dist ? p1 : 0;
+				space_lo = space_hi = p0;
+				marks = 0;
+			}
+
 			/*
 			 * this bit tries to adapt with manchester sequences that
 			 * don't start with a series of 'zeroes'...
@@ -298,11 +884,15 @@ AVR_CR(cr_syncsearch)
 				syncduration = d;
 				synclen = 0;
 				manchester = 0;
+				pwm = 0;
 				D(pin_clr(pin_Debug2);)
 			} else {
 				D(pin_set(pin_Debug2);)
+				uint8_t s = p0 < p1 ? p0 : p1;
 				if (abs_sub(p1, p0) < (d / 8))
 					manchester++;
+				else if (s * 3 <= d && s * 5 >= d)
+					pwm++;
 				/* Integrate half the difference with previous cycle,
 				 * turns out some transmitter start a bit sluggish
 				 * and gradually get to 'speed' */
@@ -312,43 +902,66 @@ AVR_CR(cr_syncsearch)
 			pi++;
 		}
 
-		if (synclen == SYNC_LEN) {
+		if (synclen == SYNC_LEN || spaced) {
 			uint8_t newstate = state_SyncSearch;
 			D(pin_set(pin_Debug1);)
+			stats.syncs++;
 
+			if (synclen < SYNC_LEN)
+				syncstart = markstart;
 			if (flags.display_pulses)
 				newstate = state_DecodeRawPulses;
-			else if (syncduration > 0x80)
-				newstate = state_Decoding_OOK;
-			else if (manchester > 4)
-				newstate = state_Decoding_Manchester;
+			else if (marks >= SYNC_LEN)
+				/* equal pulses can be the start of one of these too */
+				newstate = state_Decoding_Distance;
 			else
-				newstate = state_Decoding_ASK;
+				newstate = sync_decoder(pwm, manchester);
 			// init decoders
 			while (newstate != state_SyncSearch) {
-				msg_start = syncstart;
+				msg_start = newstate == state_Decoding_Distance ?
+						markstart : syncstart;
 
 				chk = 0x55;
 				bcount = 0;
 				byte = 0;
 				msg_end = 0;
 				decoded = 0;
+				erased = 0;
 				running_state = newstate;
 
 				while (running_state != state_SyncSearch)
 					cr_yield(1);
 				/*
-				 * if ASK fails (it's strict) and we had a small
+				 * Not a fixed code remote, it can still be plain ASK
+				 * (or OOK, for the slow ones).
+				 * If ASK fails (it's strict) and we had a small
 				 * chance of doing some manchester, well, try again
 				 * with manchester, you never know
 				 */
-				if (newstate == state_Decoding_ASK &&
+				if (newstate == state_Decoding_Distance && !decoded &&
+						synclen == SYNC_LEN) {
+					newstate = sync_decoder(pwm, manchester);
+				} else if (newstate == state_Decoding_Fixed && !decoded) {
+					newstate = syncduration > 0x80 ?
+							state_Decoding_OOK : state_Decoding_ASK;
+				} else if (newstate == state_Decoding_ASK &&
 						manchester && !decoded) {
 					newstate = state_Decoding_Manchester;
 				} else
 					break;
 			}
-			synclen = manchester = syncduration = 0;
+			/* a sync no decoder wanted; noise, or a collision */
+			if (!decoded && newstate != state_DecodeRawPulses)
+				stats.fails++;
+			synclen = manchester = pwm = syncduration = 0;
+			marks = mark = 0;
+			/*
+			 * a decoder can fail right on the sync start, we'd find the
+			 * same sync again (and count it again) until the ring wraps
+			 */
+			if (!decoded &&
+					(msg_start == syncstart || msg_start == markstart))
+				msg_start = syncstart + 1;
 			pi = msg_start;// play catchup
 			syncstart = pi+1;
 			D(pin_clr(pin_Debug1);)
@@ -364,7 +977,7 @@ AVR_CR(cr_syncsearch_backward)
 		while (pi == current_pulse || running_state != state_SyncSearch) {
 			if (running_state == state_SyncSearch) {
 			//	if (synclen == 0) {
-					if (!uart_rx_isempty(&uart_rx))
+					if (uart_rx_ready())
 						running_state = state_ReceivingCommand;
 			//	}
 			}
@@ -468,9 +1081,9 @@ AVR_CR(cr_decode_ask)
 
 		pi = msg_start;	/* restart at beginning */
 		decoded = 1;
-		uart_putchar('M', 0);
-		uart_putchar('A', 0);
-		uart_putchar(':', 0);
+		putchar('M');
+		putchar('A');
+		putchar(':');
 		D(pin_set_to(pin_Debug3, 0);)
 		do {
 			// wait for bits
@@ -480,6 +1093,9 @@ AVR_CR(cr_decode_ask)
 				uint8_t b = pulse[pi][1] > pulse[pi][0];
 				D(pin_set_to(pin_Debug3, b);)
 				msg_end = pulse[pi][0] >= MAX_TICKS_PER_PHASE;
+				/* phases too close to call */
+				if (abs_sub(pulse[pi][1], pulse[pi][0]) < (syncduration / 8))
+					erasebit();
 				stuffbit(b, msg_end);
 				pi++;
 				D(pin_set_to(pin_Debug3, 0);)
@@ -534,9 +1150,9 @@ AVR_CR(cr_decode_ook)
 
 		pi = msg_start;	/* restart at beginning */
 		decoded = 1;
-		uart_putchar('M', 0);
-		uart_putchar('O', 0);
-		uart_putchar(':', 0);
+		putchar('M');
+		putchar('O');
+		putchar(':');
 		D(pin_set_to(pin_Debug3, 0);)
 		do {
 			// wait for bits
@@ -558,6 +1174,16 @@ AVR_CR(cr_decode_ook)
 	} while (1);
 }
 
+/*
+ * The manchester decoder can be quite a few bits behind the pulses, stop
+ * before the bit count wraps
+ */
+#ifdef LONG_FRAMES
+#define BCOUNT_MAX	0xff00
+#else
+#define BCOUNT_MAX	0xd0
+#endif
+
 /*
  * After we got a sync, and it's been decided it's manchester, go on
  * and do the decoding on the fly until and end of pulse
@@ -597,14 +1223,26 @@ AVR_CR(cr_decode_manchester)
 
 		pi = msg_start;	/* restart at beginning */
 		decoded = 1;
-		uart_putchar('M', 0);
-		uart_putchar('M', 0);
-		uart_putchar(':', 0);
+		putchar('M');
+		putchar('M');
+		putchar(':');
 		D(pin_set_to(pin_Debug3, 0);)
 		// We know what a half pulse is, it's synclen / 2
 		uint8_t bit = 0, phase = 1;
 		uint8_t demiclock = 0;
 		uint8_t stuffclock = 0;
+		/*
+		 * Clock recovery; cheap transmitters drift during long frames,
+		 * so every phase we recognise nudges the bit period towards what
+		 * it measured, 1/8th of the error at a time. 'clock' is the bit
+		 * period in 1/16th of ticks, and isn't allowed to wander more
+		 * than 1/4 away from the sync.
+		 */
+		uint16_t clock = (uint16_t)syncduration << 4;
+		const uint16_t clock_min = clock - (clock / 4);
+		uint16_t clock_max = clock + (clock / 4);
+		if (clock_max > ((uint16_t)MAX_TICKS_PER_PHASE << 4))
+			clock_max = (uint16_t)MAX_TICKS_PER_PHASE << 4;
 
 		do {
 			// wait for bits
@@ -624,10 +1262,26 @@ AVR_CR(cr_decode_manchester)
 						stuffbit(bit, msg_end);
 					stuffclock++;
 				}
+				uint8_t d = pulse[pi][phase];
+				uint8_t sd = clock >> 4;
+				margin = sd / 4;
+				// error against the bit period, in 1/16th of ticks
+				int16_t err = 0;
 				// if the phase is double the demiclock, change polarity
-				if (abs_sub(pulse[pi][phase], syncduration) < margin) {
+				if (abs_sub(d, sd) < margin) {
 					bit = phase;
 					demiclock++;
+					err = ((uint16_t)d << 4) - clock;
+				} else if (abs_sub(d, sd / 2) < margin)
+					err = ((uint16_t)d << 5) - clock;
+				else if (d < MAX_TICKS_PER_PHASE)
+					erasebit();	// neither a demi clock nor a full one
+				if (err) {
+					clock += err / 8;
+					if (clock < clock_min)
+						clock = clock_min;
+					else if (clock > clock_max)
+						clock = clock_max;
 				}
 				demiclock++;
 				if (stuffclock != demiclock) {
@@ -639,7 +1293,7 @@ AVR_CR(cr_decode_manchester)
 				if (phase == 0) pi++;
 				phase = !phase;
 			}
-		} while (!msg_end && bcount < 0xd0);
+		} while (!msg_end && bcount < BCOUNT_MAX);
 
 		running_state = state_DecodeDone;
 		msg_start = pi;
@@ -647,6 +1301,138 @@ AVR_CR(cr_decode_manchester)
 	} while (1);
 }
 
+/*
+ * Fixed code remotes. PT2262/EV1527 style PWM; a short and a long phase
+ * (1:2 to 1:3) per bit and a long low sync at the end. Or pulse distance;
+ * a constant mark, the length of the space that follows is the bit.
+ * These frames are short and there are no erasures in PWM, so the whole
+ * frame is checked first, then printed straight from the pulse buffer.
+ * The type letter tells which; 'T' for a PT2262 tri-state code (bit
+ * pairs 00, 11 and 01 for '0', '1' and 'F', with at least one 'F'), 'E'
+ * for any other PWM code, 'D' for pulse distance.
+ */
+#define FIXED_MIN_BITS	20	// like ASK, shorter ones are truncated frames
+#define FIXED_MAX_BITS	64
+
+AVR_CR(cr_decode_fixed)
+{
+	do {
+		cr_yield(0);
+
+		uint8_t distance = running_state == state_Decoding_Distance;
+		uint8_t pi = msg_start;
+		uint8_t bits = 0, ok = 1;
+		uint8_t tristate = 1, floats = 0, last = 0;
+		uint8_t lo = MAX_TICKS_PER_PHASE, hi = 0;
+		uint8_t tol = syncduration / 8;
+		uint8_t mark = pulse[pi][1];
+
+		do {
+			while (pi == current_pulse)
+				cr_yield(0);
+			uint8_t p0 = pulse[pi][0], p1 = pulse[pi][1];
+			if (p0 >= MAX_TICKS_PER_PHASE)
+				break;	// sync, or end of frame
+			if (distance) {
+				ok = abs_sub(p1, mark) <= mark / 4 && p0 >= p1 - (p1 / 4);
+				if (p0 < lo)
+					lo = p0;
+				if (p0 > hi)
+					hi = p0;
+			} else {
+				uint16_t d = p0 + p1;
+				uint8_t s = p0 < p1 ? p0 : p1;
+				uint8_t b = p1 > p0;
+				ok = d <= syncduration + tol && d + tol >= syncduration &&
+						s * 3 <= d && s * 5 >= d;
+				if (bits & 1) {
+					if (last && !b)
+						tristate = 0;
+					else if (!last && b)
+						floats++;
+				}
+				last = b;
+			}
+			bits++;
+			pi++;
+		} while (ok && bits <= FIXED_MAX_BITS);
+
+		if (!ok || bits < FIXED_MIN_BITS || bits > FIXED_MAX_BITS ||
+				(distance && hi <= lo + (lo / 2))) {
+			decoded = 0;
+			msg_start = pi;
+			running_state = state_SyncSearch;
+			continue;
+		}
+		decoded = 1;
+		if (distance)
+			syncduration = mark;
+		putchar('M');
+		putchar(distance ? 'D' :
+				tristate && floats && bits == 24 ? 'T' : 'E');
+		putchar(':');
+		/* half way between the two space lengths */
+		uint8_t threshold = lo + ((hi - lo) / 2);
+		pi = msg_start;
+		for (uint8_t i = 0; i < bits; i++, pi++) {
+			uint8_t b;
+			if (distance) {
+				b = pulse[pi][0] > threshold;
+				if (abs_sub(pulse[pi][0], threshold) < (hi - lo) / 8)
+					erasebit();
+			} else
+				b = pulse[pi][1] > pulse[pi][0];
+			stuffbit(b, i == bits - 1);
+		}
+		running_state = state_DecodeDone;
+		msg_start = pi + 1;	// past the sync
+	} while (1);
+}
+
+/*
+ * Packed raw pulses, for the PACK command. A phase uses the first entry
+ * within 1/8th of it; the silence at the end is always sent as is. The
+ * bits go MSB first, in hex bytes like the other messages. That's about
+ * a quarter of the 'MP' size.
+ */
+static struct {
+	uint8_t		table[PACK_TABLE], used;
+	uint8_t		bits;		// in 'acc', not sent yet
+	uint16_t	acc;
+} pack;
+
+static void
+pack_bits(
+		uint8_t v,
+		uint8_t n)
+{
+	pack.acc = (pack.acc << n) | v;
+	pack.bits += n;
+	if (pack.bits >= 8) {
+		pack.bits -= 8;
+		uint8_t b = pack.acc >> pack.bits;
+		printf_P(PSTR("%02x"), b);
+		chk += b;
+	}
+}
+
+static void
+pack_phase(
+		uint8_t d)
+{
+	if (d < MAX_TICKS_PER_PHASE) {
+		for (uint8_t i = 0; i < pack.used; i++)
+			if (abs_sub(d, pack.table[i]) <= pack.table[i] / 8) {
+				pack_bits(i, 2);
+				return;
+			}
+		if (pack.used < PACK_TABLE)
+			pack.table[pack.used++] = d;
+	}
+	pack_bits(PACK_ESCAPE, 2);
+	pack_bits(d, 8);
+}
+
 /*
  * Raw print of the pulses. Used for debug and in 'learning mode'
  * for remotes, buttons and so forth.
@@ -657,24 +1443,326 @@ AVR_CR(cr_decode_pulses)
 		cr_yield(0);
 
 		uint8_t pi = msg_start;
-		printf_P(PSTR("MP:"));
+		if (flags.pack_pulses) {
+			printf_P(PSTR("MQ:"));
+			pack.used = pack.bits = 0;
+		} else
+			printf_P(PSTR("MP:"));
 		do {
 			// wait for bits
 			while (pi == current_pulse)
 				cr_yield(0);
 			while (pi != current_pulse && !msg_end) {
 				msg_end = pulse[pi][0] >= MAX_TICKS_PER_PHASE;
-				printf_P(PSTR("%02x%02x"), pulse[pi][1], pulse[pi][0]);
-				chk += pulse[pi][1] + pulse[pi][0];
+				if (flags.pack_pulses) {
+					pack_phase(pulse[pi][1]);
+					pack_phase(pulse[pi][0]);
+				} else {
+					printf_P(PSTR("%02x%02x"), pulse[pi][1], pulse[pi][0]);
+					chk += pulse[pi][1] + pulse[pi][0];
+				}
 				bcount++;
 				pi++;
 			}
 		} while (!msg_end);
+		if (pack.bits)	/* pad with ones, see tx_pack_check() */
+			pack_bits(0xff >> pack.bits, 8 - pack.bits);
 		msg_start = pi;
 		running_state = state_DecodeDone;
 	} while (1);
 }
 
+/*
+ * Account the pulses the receiver finished since last time; called from
+ * the main loop, it's cheap enough and never misses one as long as we
+ * don't fall 256 pulses behind.
+ */
+static void
+stats_update()
+{
+	while (stats.pi != current_pulse) {
+		uint8_t p0 = pulse[stats.pi][0], p1 = pulse[stats.pi][1];
+		uint16_t d = p1 + (p0 < MAX_TICKS_PER_PHASE ? p0 : 0);
+
+		stats.pulses++;
+		if (running_state == state_SyncSearch)
+			stats.idle++;
+		stats.busy += d;
+		stats.hist[d / 64 < STATS_BUCKETS ? d / 64 : STATS_BUCKETS - 1]++;
+		stats.pi++;
+	}
+}
+
+/*
+ * Pick the receiver rate; called from the main loop, a new pulse is the
+ * activity that gets us back to the full rate.
+ */
+static void
+rx_speed_update()
+{
+	static uint8_t pi, tick;
+	static uint16_t idle;	// ticks without a pulse
+	uint8_t dt = tickcount - tick;
+
+	tick += dt;
+	if (pi != current_pulse) {
+		pi = current_pulse;
+		idle = 0;
+		rx_set_speed(0);
+		return;
+	}
+	if (!rx_idle_ms || running_state != state_SyncSearch) {
+		idle = 0;
+		rx_set_speed(0);
+		return;
+	}
+	if (idle < rx_idle_ms * TICKS_PER_MS)
+		idle += dt;
+	else
+		rx_set_speed(1);
+}
+
+/* where the replies to the queries go, a TEST mutes stdout */
+static FILE *
+reply_out()
+{
+#ifdef SELFTEST
+	if (selftest.type)
+		return selftest.out;
+#endif
+	return stdout;
+}
+
+/* print and clear the statistics, all in hex */
+static void
+stats_report()
+{
+	FILE * o = reply_out();
+	fprintf_P(o, PSTR("*S%04x,%04x,%08lx,%04x,%04x,%04x"),
+			stats.pulses, stats.idle, stats.busy,
+			stats.syncs, stats.fails, stats.frames);
+	for (uint8_t i = 0; i < STATS_BUCKETS; i++)
+		fprintf_P(o, PSTR(",%04x"), stats.hist[i]);
+	fprintf_P(o, PSTR("\n"));
+	uint8_t pi = stats.pi;
+	memset(&stats, 0, sizeof(stats));
+	stats.pi = pi;
+#ifdef SELFTEST
+	/* or the end of the TEST puts back what we just reported */
+	selftest.syncs = selftest.fails = 0;
+#endif
+}
+
+#ifdef SELFTEST
+static int
+selftest_putchar(
+		char c,
+		FILE * stream)
+{
+	return 0;
+}
+static FILE selftest_null = FDEV_SETUP_STREAM(selftest_putchar, NULL,
+										_FDEV_SETUP_WRITE);
+
+static uint8_t
+selftest_rand()
+{
+	selftest.rnd = (selftest.rnd >> 1) ^ (-(selftest.rnd & 1) & 0xb8);
+	return selftest.rnd;
+}
+
+static void
+selftest_type(
+		uint8_t type)
+{
+	selftest.type = type;
+	selftest.period = SELFTEST_PERIOD;
+	selftest.lead = 0;
+	switch (type) {
+		case 'E':
+			selftest.bits = 24;
+			break;
+		case 'A':
+			selftest.bits = 72;
+			break;
+		case 'M':
+			selftest.bits = 32;
+			/*
+			 * the decoder only knows the bit value after a full bit
+			 * phase, so it's one bit behind the one sent
+			 */
+			selftest.lead = SELFTEST_PREAMBLE - 1;
+			break;
+	}
+	/* start with the end of a frame; the silence and the next edge */
+	selftest.bit = selftest.bits +
+			(type == 'M' ? SELFTEST_PREAMBLE + SELFTEST_TAIL : 0);
+	selftest.phase = 0;
+	selftest.frame = 0xff;
+}
+
+/* called by the TEST command, the transceiver is switched after that */
+static void
+selftest_start()
+{
+	selftest.rnd = 1;
+	memset(selftest.ok, 0, sizeof(selftest.ok));
+	selftest.syncs = stats.syncs;
+	selftest.fails = stats.fails;
+	selftest.display_pulses = flags.display_pulses;
+	flags.display_pulses = 0;
+	selftest.jitter = 0;
+	selftest.good = 0;
+	selftest.settle = 0;
+	selftest_type('E');
+	/* the decoders output goes nowhere meanwhile */
+	selftest.out = stdout;
+	stdout = &selftest_null;
+}
+
+/* done, or any command interrupts it */
+static void
+selftest_stop()
+{
+	if (!selftest.type)
+		return;
+	selftest.type = 0;
+	stdout = selftest.out;
+	stats.syncs = selftest.syncs;
+	stats.fails = selftest.fails;
+	flags.display_pulses = selftest.display_pulses;
+}
+
+/* a frame was decoded, check it's the one we sent */
+static void
+selftest_check()
+{
+	if (!selftest.bad && bcount >= selftest.lead + selftest.bits)
+		selftest.good = 1;
+	selftest.bad = 0;
+}
+
+/* count the frame we just sent, set up the next one; 0 when done */
+static uint8_t
+selftest_next()
+{
+	selftest.ok[selftest.jitter] += selftest.good;
+	if (++selftest.frame == SELFTEST_FRAMES) {
+		selftest.frame = 0;
+		if (++selftest.jitter == SELFTEST_JITTERS) {
+			selftest.jitter = 0;
+			fprintf_P(selftest.out, PSTR("*T%c%02x:"),
+					selftest.type, selftest.period);
+			for (uint8_t i = 0; i < SELFTEST_JITTERS; i++)
+				fprintf_P(selftest.out, PSTR("%x"), selftest.ok[i]);
+			fprintf_P(selftest.out, PSTR("\n"));
+			memset(selftest.ok, 0, sizeof(selftest.ok));
+			if (selftest.period < SELFTEST_PERIOD * SELFTEST_PERIODS)
+				selftest.period += SELFTEST_PERIOD;
+			else if (selftest.type == 'E')
+				selftest_type('A');
+			else if (selftest.type == 'A')
+				selftest_type('M');
+			else {
+				fprintf_P(selftest.out, PSTR("*T.\n"));
+				return 0;
+			}
+			selftest.frame = 0;
+		}
+	}
+	for (uint8_t i = 0; i < sizeof(selftest.data); i++)
+		selftest.data[i] = selftest_rand();
+	selftest.bit = selftest.phase = 0;
+	selftest.bad = selftest.good = 0;
+	return 1;
+}
+
+/* what the receiver would see for 'd' ticks of 'level' */
+static void
+selftest_feed(
+		uint8_t level,
+		uint8_t d)
+{
+	while (d--)
+		rx_sample(level);
+}
+
+/* the 'k'th bit of the frame sent */
+static uint8_t
+selftest_sent(
+		uint8_t k)
+{
+	if (selftest.type == 'M') {
+		if (k < SELFTEST_PREAMBLE || k >= SELFTEST_PREAMBLE + selftest.bits)
+			return 0;
+		k -= SELFTEST_PREAMBLE;
+	}
+	return (selftest.data[k / 8] >> (7 - (k % 8))) & 1;
+}
+
+/*
+ * Called by the main loop, sends one phase per round. A frame starts with
+ * the rising edge that ends the previous one, we wait there for the
+ * decoders to be done with that before counting it.
+ */
+static void
+selftest_step()
+{
+	if (selftest.settle) {
+		if (--selftest.settle)
+			return;
+		if (!selftest_next()) {
+			selftest_stop();
+			enable_receiver();
+			running_state = state_SyncSearch;
+			msg_start = msg_end = 0;
+			rx_reset();
+			stats.pi = 0;
+			return;
+		}
+		/* manchester starts low, that's part of the silence */
+		if (selftest.type == 'M')
+			selftest.phase = 1;
+	}
+	uint8_t manchester = selftest.type == 'M';
+	uint8_t len = selftest.bits +
+			(manchester ? SELFTEST_PREAMBLE + SELFTEST_TAIL : 0);
+	if (selftest.bit == len) {
+		/* PWM has a short sync before the silence */
+		if (!manchester)
+			selftest_feed(1, selftest.period / 3);
+		selftest_feed(0, MAX_TICKS_PER_PHASE);
+		selftest_feed(1, 1);
+		selftest.settle = SELFTEST_SETTLE;
+		return;
+	}
+	uint8_t u = selftest_sent(selftest.bit);
+	uint8_t level, d;
+	if (manchester) {
+		/* a one is high then low */
+		level = u ^ selftest.phase;
+		d = selftest.period / 2;
+	} else {
+		/* a one is a long high phase then a short low one */
+		uint8_t s = selftest.period / 3;
+		level = !selftest.phase;
+		d = u ^ selftest.phase ? selftest.period - s : s;
+	}
+	if (selftest.jitter) {
+		uint8_t j = ((uint16_t)selftest.period * selftest.jitter) / 64;
+		int16_t v = d + (selftest_rand() % ((2 * j) + 1)) - j;
+		d = v < 1 ? 1 : v > MAX_TICKS_PER_PHASE ? MAX_TICKS_PER_PHASE : v;
+	}
+	/* the first one already had it's edge */
+	if (selftest.bit == 0 && selftest.phase == manchester)
+		d--;
+	selftest_feed(level, d);
+	selftest.phase = !selftest.phase;
+	if (!selftest.phase)
+		selftest.bit++;
+}
+#endif
+
 /*
  * Reads a character from the uart FIFO, return 0xff if we timeouted
  */
@@ -691,7 +1779,7 @@ uart_recv()
 		} else
 			cr_yield(0);
 	}
-	return uart_rx_isempty(&uart_rx) ? 0xff : uart_rx_read(&uart_rx);
+	return uart_rx_isempty(&uart_rx) ? 0xff : uart_getchar();
 }
 
 /* Receive from the uart, matching a string in flash, eventually returns
@@ -734,17 +1822,72 @@ getsbyte(
 	return 0;
 }
 
+/*
+ * Wait for the channel to be idle for lbt_idle_ms before keying up, so we
+ * don't step on another device frame. If we see activity, we restart
+ * waiting with a random extra delay, but we never wait more than
+ * LBT_MAX_WAIT. Returns the ticks we waited.
+ */
+static uint16_t
+listen_before_talk()
+{
+	static uint8_t rnd = 0;
+	uint16_t want = lbt_idle_ms * TICKS_PER_MS;
+	uint16_t idle = 0, waited = 0;
+	uint8_t tick = tickcount;
+	uint8_t activity = listen_activity;
+
+	if (!want)
+		return 0;
+	enable_listener();
+	while (idle < want && waited < LBT_MAX_WAIT) {
+		cr_yield(1);
+		uint8_t dt = tickcount - tick;
+		tick += dt;
+		idle += dt;
+		waited += dt;
+		if (activity != listen_activity) {
+			activity = listen_activity;
+			// galois LFSR, seeded with whatever the timer was at
+			if (!rnd)
+				rnd = tick | 1;
+			rnd = (rnd >> 1) ^ (-(rnd & 1) & 0xb8);
+			idle = 0;
+			want = (lbt_idle_ms * TICKS_PER_MS) + ((rnd & 0x3f) * 8);
+		}
+	}
+	disable_transceiver();
+	return waited;
+}
+
+/*
+ * 'sync' is the high phase before the final long low; fixed code remotes
+ * have a short one there. A packed frame has it's own end already.
+ * It's sent 'repeats' times (3 if 0), with 'gap' ms of silence after
+ * each.
+ */
 static void
-transmit_message()
+transmit_message(
+		uint8_t sync,
+		uint8_t repeats,
+		uint8_t gap)
 {
-	pulse[bcount][0] = MAX_TICKS_PER_PHASE; // long low pulse
-	pulse[bcount][1] = 0;
-	msg_end = bcount + 1;
-	msg_start = 0;
-	if (msg_end <= 16)	// too small, don't bother
+	if (tx_pack.packed)
+		tx_end = bcount;
+	else {
+		pulse[bcount][0] = MAX_TICKS_PER_PHASE; // long low pulse
+		pulse[bcount][1] = sync;
+		tx_end = bcount + 1;
+	}
+	if (tx_end <= 16)	// too small, don't bother
 		return;
-	uint8_t retries = 3;
+	uint16_t waited = listen_before_talk();
+	/* let the host know we deferred the transmission, in ms */
+	if (waited >= TICKS_PER_MS)
+		printf_P(PSTR("*D%04x\n"), waited / TICKS_PER_MS);
+	uint8_t retries = repeats ? repeats : 3;
 	while (retries--) {
+		tx_gap = gap * TICKS_PER_MS;
 		enable_transmitter();
 		// switch antenna to the TX
 		while (transceiver_mode != mode_Idle) {
@@ -769,12 +1912,23 @@ AVR_CR(cr_receive_cmd)
 		uint8_t state = 0;
 		uint8_t err = 0;
 		uint8_t b;
+		uint8_t query;
 		static uint8_t byte;
 
 		b = uart_recv();
-		if (b == 0xff)
-			goto again;
-		disable_transceiver();
+		/*
+		 * STATS and FLOW only reply, the host polls them; they leave the
+		 * receiver, the frames not printed yet and a TEST alone
+		 */
+		query = b == 'S' || b == 'F';
+		if (!query) {
+#ifdef SELFTEST
+			selftest_stop();
+#endif
+			if (b == 0xff)
+				goto again;
+			disable_transceiver();
+		}
 		if (b == 'M') {
 			uint8_t msg_type = uart_recv();
 			if (msg_type == 0xff)
@@ -782,12 +1936,15 @@ AVR_CR(cr_receive_cmd)
 
 			switch (msg_type) {
 			case 'A':
+			case 'E':
+			case 'T':
 				syncduration = 0x63;	/* default ASK bit duration */
 				break;
 			case 'M':
 				syncduration = 0x40;/* default manchester clock * 2 */
 				break;
 			case 'P':
+			case 'Q':
 				break;
 			default:
 				err = b;
@@ -795,6 +1952,9 @@ AVR_CR(cr_receive_cmd)
 			}
 			bcount = 0;
 			uint8_t chk = 0x55;
+			uint8_t repeats = 0, gap = 0;
+			uint16_t packed = 0;	// bytes of a 'Q'
+			tx_pack.packed = msg_type == 'Q';
 			do {
 				b = uart_recv();
 newkey:
@@ -808,6 +1968,13 @@ newkey:
 						// here we /know we got a valid hex value
 						switch (msg_type) {
 						case 'A':
+						case 'E':
+						case 'T':
+							/* and one for the sync */
+							if (bcount >= TX_PULSES - 8) {
+								err = ':';
+								goto skipline;
+							}
 							for (uint8_t b = 0; b < 8; b++) {
 								uint8_t bit = (byte >> (7-b)) & 1;
 								pulse[bcount][bit] =
@@ -821,6 +1988,14 @@ newkey:
 							break;
 						case 'P':
 							break;
+						case 'Q':
+							/* the unpacker reads one byte ahead */
+							if (packed >= sizeof(pulse) - 1) {
+								err = ':';
+								goto skipline;
+							}
+							((volatile uint8_t *)pulse)[packed++] = byte;
+							break;
 						}
 					} while (1);
 					break;
@@ -830,8 +2005,15 @@ newkey:
 				//	printf_P(PSTR("< %d chk %02x/%02x\n"),
 				//			current_pulse, b, chk);
 					if (b == chk) {
+						/* what the packed bytes hold has to be the count */
+						if (tx_pack.packed && tx_pack_check(packed, bcount)) {
+							err = ':';
+							goto skipline;
+						}
 						state++;
-						transmit_message();
+						transmit_message(msg_type == 'A' ||
+								msg_type == 'P' ? 0 : syncduration / 4,
+								repeats, gap);
 						goto skipline;
 					} else {
 						err = '*';
@@ -843,19 +2025,49 @@ newkey:
 						goto skipline;
 					chk += syncduration;
 					break;
+				case '+': /* times to send it */
+					if (getsbyte(&repeats))
+						goto skipline;
+					chk += repeats;
+					break;
+				case '/': /* ms of silence after each */
+					if (getsbyte(&gap))
+						goto skipline;
+					chk += gap;
+					break;
 				case '#': /* number of bits total */
-					if (getsbyte(&bcount))
+					if (getsbyte(&byte))
 						goto skipline;
-					chk += bcount;
+					bcount = byte;
+					chk += byte;
 					break;
+#ifdef LONG_FRAMES
+				case '&': /* same, 16 bits */
+					if (getsbyte(&byte))
+						goto skipline;
+					bcount = byte << 8;
+					chk += byte;
+					if (getsbyte(&byte))
+						goto skipline;
+					bcount |= byte;
+					chk += byte;
+					break;
+#endif
 				default:
 					err = b;
 					goto skipline;
 				}
 			} while (1);
 		} else if (b == 'P') {
+			/* PULSE, or PACK for the packed version */
 			if ((b = recv_match_string_P(PSTR("PULSE\n"))) == '\n') {
 				flags.display_pulses = 1;
+				flags.pack_pulses = 0;
+				state++;
+			} else if (b == 'A' &&
+					(b = recv_match_string_P(PSTR("ACK\n"))) == '\n') {
+				flags.display_pulses = 1;
+				flags.pack_pulses = 1;
 				state++;
 			} else
 				err = b;
@@ -866,21 +2078,79 @@ newkey:
 			} else
 				err = b;
 		}
-#ifdef STACK_DEBUG
-		else if (b == 'S') {
-			if ((b = recv_match_string_P(PSTR("STACK\n"))) == '\n') {
-				flags.display_stacks = 1;
+		else if (b == 'L') {
+			/* LBTxx: listen before talk idle time, in ms, 0 disables */
+			if ((b = recv_match_string_P(PSTR("LBT"))) == 'T' &&
+					!(b = getsbyte(&lbt_idle_ms))) {
+				b = uart_recv();
+				state++;
+			} else
+				err = b;
+		}
+		else if (b == 'I') {
+			/* IDLExx: ms without a pulse before the slow rate, 0 disables */
+			if ((b = recv_match_string_P(PSTR("IDLE"))) == 'E' &&
+					!(b = getsbyte(&rx_idle_ms))) {
+				b = uart_recv();
 				state++;
 			} else
 				err = b;
 		}
+		else if (b == 'F') {
+			/*
+			 * FLOW: the size of the receive FIFO; the host keeps what
+			 * it sends ahead of the "*OK" under that. No "*OK" either.
+			 */
+			if ((b = recv_match_string_P(PSTR("FLOW\n"))) == '\n')
+				fprintf_P(reply_out(), PSTR("*F%04x\n"), UART_RX_SIZE);
+			else
+				err = b;
+		}
+#ifdef SELFTEST
+		else if (b == 'T') {
+			/* TEST; the '*T' lines are the reply, there is no "*OK" */
+			if ((b = recv_match_string_P(PSTR("TEST\n"))) == '\n')
+				selftest_start();
+			else
+				err = b;
+		}
 #endif
+		else if (b == 'S') {
+			/*
+			 * STATS, and STACK when enabled; the statistics line is
+			 * the reply, there is no "*OK"
+			 */
+			if ((b = recv_match_string_P(PSTR("STA"))) != 'A')
+				err = b;
+			else if ((b = uart_recv()) == 'T') {
+				if ((b = recv_match_string_P(PSTR("TS\n"))) == '\n')
+					stats_report();
+				else
+					err = b;
+			}
+#ifdef STACK_DEBUG
+			else if (b == 'C') {
+				if ((b = recv_match_string_P(PSTR("CK\n"))) == '\n') {
+					flags.display_stacks = 1;
+					state++;
+				} else
+					err = b;
+			}
+#endif
+			else
+				err = b;
+		}
 skipline:
 		/* wait for end of line (if not already in 'b'), or timeout */
 		while (b >= ' ' && b != 0xff)
 			b = uart_recv();
-		if (err) printf_P(PSTR("!%d\n"), err);
+		if (err) fprintf_P(reply_out(), PSTR("!%d\n"), err);
 		else if (state) printf_P(PSTR("*OK\n"));
+		if (query) {
+			/* the sync search goes on from where it was */
+			running_state = state_SyncSearch;
+			continue;
+		}
 #if 0 // def SIMAVR
 		b = 255;
 		while (b--) {
@@ -892,7 +2162,13 @@ again:
 		/* release builtin pullup on antenna switch */
 		enable_receiver();
 		running_state = state_SyncSearch;
-		msg_start = msg_end = current_pulse = 0;
+		msg_start = msg_end = 0;
+		rx_reset();
+		stats.pi = 0;
+#ifdef SELFTEST
+		if (selftest.type)
+			enable_selftest();
+#endif
 	} while (1);
 }
 
@@ -901,17 +2177,19 @@ again:
  * you have enabled STACK_DEBUG. The stacks are trimmed to the minimum
  * needed, so any strange behaviour should be looked at here, first
  */
-AVR_TASK(syncsearch, 64);
+AVR_TASK(syncsearch, 72);
 AVR_TASK(decode_ask, 100);
 AVR_TASK(decode_ook, 100);
 AVR_TASK(decode_manchester, 100);
-AVR_TASK(decode_pulses, 64);
+AVR_TASK(decode_fixed, 100);
+AVR_TASK(decode_pulses, 72);
 AVR_TASK(receive_cmd, 100);
 
 void rf_bridge_run() __attribute__((noreturn)) __attribute__((naked));
 
 void rf_bridge_run()
 {
+	rx_pin_check();
 	// RF pin input and output
 	pin_input(pin_Receiver);
 	pin_clr(pin_Receiver); // no pullup on data pin
@@ -928,6 +2206,7 @@ void rf_bridge_run()
 	memset(decode_ask.stack, 0xff, sizeof(decode_ask.stack));
 	memset(decode_ook.stack, 0xff, sizeof(decode_ook.stack));
 	memset(decode_manchester.stack, 0xff, sizeof(decode_manchester.stack));
+	memset(decode_fixed.stack, 0xff, sizeof(decode_fixed.stack));
 	memset(decode_pulses.stack, 0xff, sizeof(decode_pulses.stack));
 	memset(receive_cmd.stack, 0xff, sizeof(receive_cmd.stack));
 #endif
@@ -938,6 +2217,9 @@ void rf_bridge_run()
 	printf(msg);
 	for (int8_t i = 0; msg[i]; i++)
 		uart_rx_write(&uart_rx, msg[i]);
+#ifdef UART_RX_LINES
+	uart_rx_lines++;
+#endif
 #endif
 
 	/* start coroutines on their own stacks */
@@ -945,6 +2227,7 @@ void rf_bridge_run()
 	cr_start(decode_ask, cr_decode_ask);
 	cr_start(decode_ook, cr_decode_ook);
 	cr_start(decode_manchester, cr_decode_manchester);
+	cr_start(decode_fixed, cr_decode_fixed);
 	cr_start(decode_pulses, cr_decode_pulses);
 	cr_start(receive_cmd, cr_receive_cmd);
 
@@ -953,9 +2236,18 @@ void rf_bridge_run()
 	while (1) {
 		sleep_cpu(); // wakes after a timer tick, or UART etc
 		D(GPIOR1 = running_state;)
+		if (transceiver_mode == mode_Receiving) {
+			stats_update();
+			rx_speed_update();
+		}
+#ifdef SELFTEST
+		else if (transceiver_mode == mode_SelfTest)
+			selftest_step();
+#endif
 		switch (running_state) {
 			case state_SyncSearch:
-				transceiver_mode = mode_Receiving;
+				if (transceiver_mode != mode_SelfTest)
+					transceiver_mode = mode_Receiving;
 				cr_resume(syncsearch);
 				break;
 			case state_Decoding_ASK:
@@ -967,15 +2259,38 @@ void rf_bridge_run()
 			case state_Decoding_Manchester:
 				cr_resume(decode_manchester);
 				break;
+			case state_Decoding_Fixed:
+			case state_Decoding_Distance:
+				cr_resume(decode_fixed);
+				break;
 			case state_DecodeRawPulses:
 				cr_resume(decode_pulses);
 				break;
 			case state_DecodeDone: {
 				chk += bcount;
 				chk += syncduration;
-				if (bcount)
+#ifdef SELFTEST
+				if (selftest.type)
+					selftest_check();
+				else
+#endif
+				if (bcount) {
+					/* just the ?ff when hopeless, the list may be stale */
+					if (erased > ERASE_MAX)
+						printf_P(PSTR("?ff"));
+					else for (uint8_t i = 0; i < erased; i++)
+						printf_P(PSTR("?%02x"), erase[i]);
+#ifdef LONG_FRAMES
+					if (bcount > 0xff) {
+						chk += bcount >> 8;
+						printf_P(PSTR("&%04x!%0x*%02x\n"),
+								bcount, syncduration, chk);
+					} else
+#endif
 					printf_P(PSTR("#%02x!%0x*%02x\n"),
 							bcount, syncduration, chk);
+					stats.frames++;
+				}
 				running_state = state_SyncSearch;
 				msg_end = 0;
 			}	break;
@@ -998,6 +2313,7 @@ void rf_bridge_run()
 			print_stack(syncsearch);
 			print_stack(decode_ask);
 			print_stack(decode_manchester);
+			print_stack(decode_fixed);
 			print_stack(decode_pulses);
 			print_stack(receive_cmd);
 		}
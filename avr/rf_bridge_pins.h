@@ -58,6 +58,8 @@ enum {
 	pin_Debug3,
 #endif
 };
+/* PH4 is OC4B, timer 4 makes the transmitter edges */
+#define PIN_TRANSMITTER_OC4B
 
 #elif  defined(__AVR_ATmega328P__)
 
@@ -74,6 +76,8 @@ enum {
 	pin_Debug3,
 #endif
 };
+/* PC3 can be read with sbic, the receiver ISR is in assembly then */
+#define PIN_RECEIVER_IO
 #else
 #error No pin configuration defined for this part
 #endif
@@ -49,6 +49,12 @@
 
 uart_tx_t uart_tx;
 uart_rx_t uart_rx;
+volatile uint8_t uart_rx_paused = 0;
+#ifdef UART_RX_LINES
+volatile uint8_t uart_rx_lines = 0;
+#endif
+/* XON/XOFF to send, it goes before whatever is in the TX FIFO */
+static volatile uint8_t uart_flow = 0;
 
 #ifndef USART0_UDRE_vect
 #define USART0_UDRE_vect USART_UDRE_vect
@@ -57,6 +63,11 @@ uart_rx_t uart_rx;
 
 ISR(USART0_UDRE_vect)
 {
+	if (uart_flow) {
+		UDR0 = uart_flow;
+		uart_flow = 0;
+		return;
+	}
 	if (uart_tx_isempty(&uart_tx)) {
 		UCSR0B &= ~(1 << UDRIE0);
 		return;
@@ -66,9 +77,39 @@ ISR(USART0_UDRE_vect)
 ISR(USART0_RX_vect)
 {
 	uint8_t b = UDR0;
-	if (!uart_rx_isfull(&uart_rx))
+	if (!uart_rx_isfull(&uart_rx)) {
 		uart_rx_write(&uart_rx, b);
+#ifdef UART_RX_LINES
+		if (b == '\n')
+			uart_rx_lines++;
+#endif
+	}
+	if (!uart_rx_paused &&
+			uart_rx_get_read_size(&uart_rx) >= UART_RX_XOFF) {
+		uart_rx_paused = 1;
+		uart_flow = UART_XOFF;
+		UCSR0B |= (1 << UDRIE0);
+	}
 }
+
+uint8_t uart_getchar()
+{
+	uint8_t b = uart_rx_read(&uart_rx);
+	cli();
+#ifdef UART_RX_LINES
+	if (b == '\n')
+		uart_rx_lines--;
+#endif
+	if (uart_rx_paused &&
+			uart_rx_get_read_size(&uart_rx) <= UART_RX_XON) {
+		uart_rx_paused = 0;
+		uart_flow = UART_XON;
+		UCSR0B |= (1 << UDRIE0);
+	}
+	sei();
+	return b;
+}
+
 int uart_putchar(char c, FILE *stream)
 {
 	if (c == '\n')
@@ -43,11 +43,20 @@
 
 /*
  * declare UART fifos, this is used as buffering helpers to make sure the
- * priority is always to the pulse transceiver interrupt
+ * priority is always to the pulse transceiver interrupt.
+ * The mega has the RAM to hold a few commands, so the host can send them
+ * without waiting for each "*OK"; and they are only parsed once the whole
+ * line is in, so the receiver isn't stopped while it trickles in.
  */
+#ifdef __AVR_ATmega2560__
+#define UART_RX_SIZE	256
+#define UART_RX_LINES
+#else
+#define UART_RX_SIZE	32	/* doesn't need as much */
+#endif
 
 DECLARE_FIFO(uint8_t, uart_tx, 128);
-DECLARE_FIFO(uint8_t, uart_rx, 32);	/* doesn't need as much */
+DECLARE_FIFO(uint8_t, uart_rx, UART_RX_SIZE);
 
 DEFINE_FIFO(uint8_t, uart_tx);
 DEFINE_FIFO(uint8_t, uart_rx);
@@ -55,6 +64,36 @@ DEFINE_FIFO(uint8_t, uart_rx);
 extern uart_tx_t uart_tx;
 extern uart_rx_t uart_rx;
 
+/*
+ * XON/XOFF flow control; the host is told to stop sending when the
+ * receive FIFO is half full, and to go again when it's down to 1/8th.
+ * Neither can be part of a command or of a reply.
+ */
+#define UART_XON		0x11
+#define UART_XOFF		0x13
+#define UART_RX_XOFF	(UART_RX_SIZE / 2)
+#define UART_RX_XON		(UART_RX_SIZE / 8)
+
+extern volatile uint8_t uart_rx_paused;	// the host was sent a XOFF
+#ifdef UART_RX_LINES
+extern volatile uint8_t uart_rx_lines;	// '\n' in the receive FIFO
+#endif
+
 int uart_putchar(char c, FILE *stream);
+/* read from the receive FIFO, and let the host go once there's room */
+uint8_t uart_getchar();
+
+/*
+ * Is there a command to parse? On the mega, wait for the end of the line;
+ * unless the host was stopped, it would never come.
+ */
+static inline uint8_t uart_rx_ready()
+{
+#ifdef UART_RX_LINES
+	return uart_rx_lines || uart_rx_paused;
+#else
+	return !uart_rx_isempty(&uart_rx);
+#endif
+}
 
 #endif /* _RF_BRIDGE_UART_H_ */
@@ -0,0 +1,394 @@
+/*
+ * rf_bridge_bench.c
+ *
+ *  Created on: 17 Oct 2026
+ *
+ * Microbenchmarks for the daemon hot path. Links the src/ objects (minus
+ * the daemon main) and runs each function over a fixed-seed corpus, so
+ * results are comparable between versions.
+ *
+ * Output is one tab separated line per benchmark:
+ *	<name> <ns/op> <allocs/op> <iterations>
+ * Lines starting with '#' are comments.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msg.h"
+#include "matches.h"
+#include "decode.h"
+
+/* matches.c wants this */
+const char *mqtt_root = "bench";
+
+/*
+ * Allocation counting. We interpose the allocator; glibc's own calls
+ * (asprintf, stdio etc) also go through these.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+
+static uint64_t alloc_count;
+
+void *malloc(size_t size)
+{
+	alloc_count++;
+	return __libc_malloc(size);
+}
+void *calloc(size_t n, size_t size)
+{
+	alloc_count++;
+	return __libc_calloc(n, size);
+}
+void *realloc(void *p, size_t size)
+{
+	alloc_count++;
+	return __libc_realloc(p, size);
+}
+void free(void *p)
+{
+	__libc_free(p);
+}
+
+static uint64_t
+gettime_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/* xorshift32, we want the same corpus every run */
+static uint32_t seed = 0x2017c0de;
+
+static uint32_t
+rnd()
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+#define CORPUS_SIZE		64
+
+static char switch_lines[CORPUS_SIZE][64];
+static char weather_lines[CORPUS_SIZE][64];
+static char pulse_lines[CORPUS_SIZE][1024];
+
+static msg_full_t switch_msgs[CORPUS_SIZE];
+static msg_full_t weather_msgs[CORPUS_SIZE];
+static msg_full_t pulse_msgs[CORPUS_SIZE];
+
+static FILE * devnull;
+
+static void
+msg_to_line(
+		msg_p m,
+		char * line,
+		size_t size)
+{
+	FILE *o = fmemopen(line, size, "w");
+	msg_display(o, m, "");
+	fclose(o);
+	line[strcspn(line, "\n")] = 0;
+}
+
+/* 25 bits switch codes, like the ones in rf_bridged.conf */
+static void
+corpus_switch()
+{
+	for (int i = 0; i < CORPUS_SIZE; i++) {
+		msg_full_t u;
+		uint32_t code = rnd();
+
+		msg_init(&u.m, 'A');
+		for (int b = 0; b < 25; b++)
+			msg_stuffbit(&u.m, (code >> (31 - b)) & 1);
+		u.m.pulse_duration = 0x2f + (rnd() % 0x30);
+		msg_to_line(&u.m, switch_lines[i], sizeof(switch_lines[i]));
+		msg_parse(&switch_msgs[i].m, 512, switch_lines[i]);
+	}
+}
+
+/* Ambient weather F007th frames, with valid checksums */
+static void
+corpus_weather()
+{
+	for (int i = 0; i < CORPUS_SIZE; i++) {
+		msg_full_t u;
+		uint8_t f[10] = { 0x00, 0x01, 0x45 };
+		int temp = 400 + 320 + (rnd() % 600);
+
+		f[3] = rnd();
+		f[4] = ((rnd() % 3) << 4) | ((temp >> 8) & 0x7);
+		f[5] = temp;
+		f[6] = 20 + (rnd() % 70);
+		f[7] = weather_chk(f + 2, 5);
+		f[8] = rnd();
+
+		msg_init(&u.m, 'M');
+		for (int b = 0; b < 72; b++)
+			msg_stuffbit(&u.m, (f[b / 8] >> (7 - (b % 8))) & 1);
+		u.m.pulse_duration = 0x3f;
+		msg_to_line(&u.m, weather_lines[i], sizeof(weather_lines[i]));
+		msg_parse(&weather_msgs[i].m, 512, weather_lines[i]);
+	}
+}
+
+/*
+ * Raw 'MP' lines, as sent by the firmware in PULSE mode; a bit of noise,
+ * then a few repeats of an ASK frame with some jitter.
+ */
+static void
+corpus_pulses()
+{
+	for (int i = 0; i < CORPUS_SIZE; i++) {
+		uint8_t p[256][2];
+		int pc = 0;
+		uint32_t code = rnd();
+
+		for (int n = rnd() % 8; n; n--, pc++) {
+			p[pc][0] = 2 + (rnd() % 40);
+			p[pc][1] = 2 + (rnd() % 40);
+		}
+		for (int r = 0; r < 4; r++) {
+			for (int b = 0; b < 25; b++, pc++) {
+				int bit = (code >> (31 - b)) & 1;
+				p[pc][bit] = 0x24 + (rnd() % 5) - 2;
+				p[pc][!bit] = 0x0c + (rnd() % 5) - 2;
+			}
+			p[pc][0] = 0;
+			p[pc++][1] = 0xff;
+		}
+		char *d = pulse_lines[i];
+		uint8_t chk = 0x55;
+		d += sprintf(d, "MP:");
+		for (int pi = 0; pi < pc; pi++) {
+			d += sprintf(d, "%02x%02x", p[pi][0], p[pi][1]);
+			chk += p[pi][0] + p[pi][1];
+		}
+		chk += pc + 0x30;
+		sprintf(d, "#%02x!%02x*%02x", pc, 0x30, chk);
+		msg_parse(&pulse_msgs[i].m, 512, pulse_lines[i]);
+	}
+}
+
+/*
+ * Long pulse trains, like a noisy capture; short random pulses with the
+ * odd plausible pair, and a sync near the end.
+ */
+#define TRAIN_SIZE		4096
+
+static pulse_t trains[CORPUS_SIZE][TRAIN_SIZE];
+
+static void
+corpus_trains()
+{
+	for (int i = 0; i < CORPUS_SIZE; i++) {
+		pulse_t *p = trains[i];
+		int n = TRAIN_SIZE - 64 - (rnd() % 256);
+
+		for (int pi = 0; pi < TRAIN_SIZE; pi++) {
+			p[pi][0] = 2 + (rnd() % 30);
+			p[pi][1] = 2 + (rnd() % 30);
+		}
+		for (int pi = n; pi < n + 32; pi++) {
+			int bit = rnd() & 1;
+			p[pi][bit] = 0x24 + (rnd() % 5) - 2;
+			p[pi][!bit] = 0x0c + (rnd() % 5) - 2;
+		}
+	}
+}
+
+/* a mapping file worth of matches, half of the switch corpus */
+static void
+corpus_matches()
+{
+	fileio_t f = { .fname = "bench" };
+
+	for (int i = 0; i < CORPUS_SIZE; i += 2) {
+		char l[128];
+		f.linecount++;
+		snprintf(l, sizeof(l), "%s\tswitch/bench%d\t2\t{\"on\":%s}",
+				switch_lines[i], i, i & 2 ? "true" : "false");
+		parse_matches(&f, l);
+	}
+}
+
+typedef void (*bench_run_p)(int i);
+
+static volatile int sink;
+
+static void
+run_parse_switch(int i)
+{
+	msg_full_t u;
+	sink += msg_parse(&u.m, 512, switch_lines[i]);
+}
+
+static void
+run_parse_pulses(int i)
+{
+	msg_full_t u;
+	sink += msg_parse(&u.m, 512, pulse_lines[i]);
+}
+
+static void
+run_display(int i)
+{
+	msg_display(devnull, &switch_msgs[i].m, "");
+}
+
+static void
+run_pulse_decoder(int i)
+{
+	msg_full_t o;
+	pulse_decoder(&pulse_msgs[i].m, &o.m);
+	sink += o.m.bitcount;
+}
+
+static void
+run_weather_chk(int i)
+{
+	sink += weather_chk(weather_msgs[i].m.msg + 1, 5);
+}
+
+static void
+run_weather(int i)
+{
+	msg_full_t u;
+	weather_t w;
+	msg_parse(&u.m, 512, weather_lines[i]);
+	if (weather_find(&u.m) == 0 && weather_decode(&u.m, &w) == 0)
+		sink += w.temp;
+}
+
+static void
+run_shift(int i)
+{
+	msg_full_t u;
+	memcpy(&u, &weather_msgs[i], sizeof(msg_t) + 16);
+	msg_shift(&u.m, i & 7);
+	sink += u.m.msg[0];
+}
+
+static void
+run_match(int i)
+{
+	msg_match_t *m = match_find(matches, &switch_msgs[i].m);
+	while (m) {
+		sink++;
+		m = match_find(m->next, &switch_msgs[i].m);
+	}
+}
+
+static void
+run_sync_scalar(int i)
+{
+	pulse_sync_t s;
+	sink += pulse_sync_scalar(trains[i], 0, TRAIN_SIZE, &s) + s.start;
+}
+
+static void
+run_sync(int i)
+{
+	pulse_sync_t s;
+	sink += pulse_sync(trains[i], TRAIN_SIZE, &s) + s.start;
+}
+
+static void
+run_sync_c(int i)
+{
+	pulse_simd_disable(1);
+	run_sync(i);
+	pulse_simd_disable(0);
+}
+
+static const struct {
+	const char *	name;
+	bench_run_p		run;
+} benches[] = {
+	{ "msg_parse/switch", run_parse_switch },
+	{ "msg_parse/pulses", run_parse_pulses },
+	{ "msg_display/switch", run_display },
+	{ "pulse_decoder", run_pulse_decoder },
+	{ "weather_chk", run_weather_chk },
+	{ "weather_decode/line", run_weather },
+	{ "msg_shift", run_shift },
+	{ "match_find", run_match },
+	{ "pulse_sync/scalar", run_sync_scalar },
+	{ "pulse_sync/c", run_sync_c },
+	{ "pulse_sync/simd", run_sync },
+};
+
+int
+main(
+		int argc,
+		const char *argv[])
+{
+	unsigned min_ms = 200;
+	const char * filter = NULL;
+	FILE * out = fdopen(dup(1), "w");
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-t") && i < (argc-1)) {
+			min_ms = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-o") && i < (argc-1)) {
+			fclose(out);
+			out = fopen(argv[++i], "w");
+			if (!out) {
+				perror(argv[i]);
+				exit(1);
+			}
+		} else if (!filter)
+			filter = argv[i];
+		else {
+			fprintf(stderr,
+					"%s: [-t <min ms per bench>] [-o <output>] [filter]\n",
+					argv[0]);
+			exit(1);
+		}
+	}
+	/* the decoders print to stdout, we don't want that in the results */
+	devnull = fopen("/dev/null", "w");
+	if (!freopen("/dev/null", "w", stdout))
+		perror("/dev/null");
+
+	corpus_switch();
+	corpus_weather();
+	corpus_pulses();
+	corpus_matches();
+	corpus_trains();
+
+	fprintf(out, "# pulse_sync/simd kernel: %s\n", pulse_simd_name());
+	fprintf(out, "# name\tns/op\tallocs/op\titerations\n");
+	for (int bi = 0; bi < sizeof(benches) / sizeof(benches[0]); bi++) {
+		if (filter && !strstr(benches[bi].name, filter))
+			continue;
+		uint64_t iter = 0, allocs = alloc_count;
+		uint64_t start = gettime_ns(), now = start;
+		/* run whole corpus passes until we've spent long enough */
+		do {
+			for (int i = 0; i < CORPUS_SIZE; i++)
+				benches[bi].run(i);
+			iter += CORPUS_SIZE;
+			now = gettime_ns();
+		} while (now - start < min_ms * 1000000ULL);
+		allocs = alloc_count - allocs;
+		fprintf(out, "%s\t%.1f\t%.2f\t%llu\n", benches[bi].name,
+				(double)(now - start) / iter,
+				(double)allocs / iter,
+				(unsigned long long)iter);
+	}
+	fclose(out);
+	return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * bridge.c
+ *
+ *  Created on: 17 Oct 2026
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "bridge.h"
+#include "fw_decode.h"
+#include "utils.h"
+
+bridge_t bridge[BRIDGE_MAX];
+int bridge_count = 0;
+
+int
+bridge_add(
+		const char * path)
+{
+	if (bridge_count == BRIDGE_MAX)
+		return -1;
+	bridge_p b = &bridge[bridge_count];
+	b->path = path;
+	b->index = bridge_count++;
+	return b->index;
+}
+
+int
+band_probe(
+		bridge_p b)
+{
+	char line[256];
+	int l;
+
+	if (write(b->serial.fd, "STATS\n", 6) != 6)
+		return -1;
+	/* older firmwares reply with an error, or not at all */
+	while ((l = serial_getline(&b->serial, line, sizeof(line), 500)) > 0) {
+		uint64_t now = gettime_ms();
+		if (band_parse(&b->band, line, now)) {
+			b->band.supported = 1;
+			b->band.asked = now;
+			return 0;
+		}
+		if (line[0] == '!')
+			break;
+	}
+	return -1;
+}
+
+int
+band_parse(
+		band_p b,
+		const char * line,
+		uint64_t now)
+{
+	uint32_t v[6 + BAND_BUCKETS];
+	int i = 0;
+	char * end;
+
+	if (line[0] != '*' || line[1] != 'S')
+		return 0;
+	line += 2;
+	for (i = 0; i < 6 + BAND_BUCKETS; i++) {
+		v[i] = strtoul(line, &end, 16);
+		if (end == line)
+			return 0;
+		line = *end == ',' ? end + 1 : end;
+	}
+	b->pulses = v[0];
+	b->idle = v[1];
+	b->busy = v[2];
+	b->syncs = v[3];
+	b->fails = v[4];
+	b->frames = v[5];
+	for (i = 0; i < BAND_BUCKETS; i++)
+		b->hist[i] = v[6 + i];
+	b->window = b->last ? now - b->last : 0;
+	b->last = now;
+	return 1;
+}
+
+int
+band_report(
+		band_p b,
+		char * dst,
+		size_t size)
+{
+	unsigned w = b->window ? b->window : 1;
+	/* in 1/10th of a % */
+	unsigned occupancy = ((uint64_t)b->busy * FW_TICK_NS) / (w * 1000ULL);
+	unsigned collision = b->syncs ? (b->fails * 1000) / b->syncs : 0;
+
+	int l = snprintf(dst, size, "{"
+			"\"window\":%u,"
+			"\"occupancy\":%u.%u,"
+			"\"noise\":%u,"
+			"\"syncs\":%u,"
+			"\"fails\":%u,"
+			"\"frames\":%u,"
+			"\"collision\":%u.%u,"
+			"\"hist\":[",
+			b->window / 1000,
+			occupancy / 10, occupancy % 10,
+			(unsigned)((b->idle * 1000ULL) / w),
+			b->syncs, b->fails, b->frames,
+			collision / 10, collision % 10);
+	for (int i = 0; i < BAND_BUCKETS && l < size; i++)
+		l += snprintf(dst + l, size - l, "%s%u", i ? "," : "", b->hist[i]);
+	if (l < size)
+		l += snprintf(dst + l, size - l, "]}");
+	return l;
+}
+
+/* quality of a burst; repeats are worth a lot more than clock jitter */
+static int
+link_burst(
+		link_p l)
+{
+	int r = l->repeats > 8 ? 8 : l->repeats;
+	int j = l->jitter > 32 ? 32 : l->jitter;
+	return (r * 16) - j;
+}
+
+void
+link_update(
+		link_p l,
+		uint8_t jitter,
+		uint64_t now)
+{
+	if (l->last && now - l->last < LINK_BURST_MS) {
+		if (l->repeats < 255)
+			l->repeats++;
+		if (jitter > l->jitter)
+			l->jitter = jitter;
+	} else {
+		/* new burst, fold the previous one in the average */
+		if (l->repeats)
+			l->score = l->score ?
+				((l->score * 3) + link_burst(l)) / 4 : link_burst(l);
+		l->repeats = 1;
+		l->jitter = jitter;
+	}
+	l->last = now;
+}
+
+int
+link_score(
+		link_p l,
+		uint64_t now)
+{
+	if (!l->last || now - l->last > LINK_STALE_MS)
+		return INT16_MIN;
+	/* include the current burst, it's the most up to date */
+	if (!l->score)
+		return link_burst(l);
+	return ((l->score * 3) + link_burst(l)) / 4;
+}
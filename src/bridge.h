@@ -0,0 +1,114 @@
+/*
+ * bridge.h
+ *
+ *  Created on: 17 Oct 2026
+ */
+
+#ifndef _BRIDGE_H_
+#define _BRIDGE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "serial.h"
+
+/*
+ * We can have more than one bridge (serial port); each have their own
+ * reader, and transmissions go to the bridge that hears the target
+ * device best.
+ */
+#define BRIDGE_MAX	4
+
+/*
+ * Band statistics, from the firmware STATS command. The firmware counts
+ * since the previous command, so we ask every BAND_PERIOD_MS and turn the
+ * counts into rates over the window.
+ */
+#define BAND_BUCKETS	8		// pulse durations, 1ms buckets
+#define BAND_PERIOD_MS	60000
+
+typedef struct band_t {
+	uint8_t		supported;		// the firmware answered STATS
+	uint64_t	asked;			// when we last sent STATS
+	uint64_t	last;			// when the previous reply came in, 0 for none
+	uint32_t	window;			// ms, covered by the current counts
+	uint16_t	pulses, idle;	// all of them, and outside of frames
+	uint32_t	busy;			// ticks in pulses
+	uint16_t	syncs, fails, frames;
+	uint16_t	hist[BAND_BUCKETS];
+} band_t, *band_p;
+
+typedef struct bridge_t {
+	const char *	path;
+	int				index;
+	pthread_t		thread;
+	serial_t		serial;
+	band_t			band;
+} bridge_t, *bridge_p;
+
+extern bridge_t bridge[BRIDGE_MAX];
+extern int bridge_count;
+
+/*
+ * How well a bridge hears a device. A device sends a burst of repeats of
+ * the same frame; we count the repeats we got and how far the clock was
+ * from the one in the mapping file, and keep a running average of that
+ * per burst.
+ */
+typedef struct link_t {
+	uint64_t	last;		// last reception
+	uint8_t		repeats;	// in the current burst
+	uint8_t		jitter;		// worst in the current burst
+	int16_t		score;		// average, of the previous bursts
+} link_t, *link_p;
+
+/* a burst is over after that much silence */
+#define LINK_BURST_MS	500
+/* and we forget about links we haven't heard for that long */
+#define LINK_STALE_MS	(24 * 3600 * 1000ULL)
+
+int
+bridge_add(
+		const char * path);
+
+/*
+ * Ask for the statistics once, before the reader runs; only the bridges
+ * that reply are polled later. Returns 0 if the firmware has STATS.
+ */
+int
+band_probe(
+		bridge_p b);
+
+/*
+ * Parse a "*S" statistics line from the firmware, returns 0 if it's not
+ * one. 'window' is 0 for the first one, we don't know what it covers.
+ */
+int
+band_parse(
+		band_p b,
+		const char * line,
+		uint64_t now);
+
+/*
+ * Format the band occupancy (% of the time in pulses), noise (pulses per
+ * second outside frames) and collisions (% of syncs that didn't decode)
+ * as JSON
+ */
+int
+band_report(
+		band_p b,
+		char * dst,
+		size_t size);
+
+void
+link_update(
+		link_p l,
+		uint8_t jitter,
+		uint64_t now);
+
+/* current quality of the link, INT16_MIN if we never heard from it */
+int
+link_score(
+		link_p l,
+		uint64_t now);
+
+#endif /* _BRIDGE_H_ */
@@ -0,0 +1,284 @@
+/*
+ * decode.c
+ *
+ *  Created on: 17 Oct 2026
+ */
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include "decode.h"
+#include "log.h"
+
+unsigned debug_sync;
+
+/* Ambient Weather F007th */
+/* details are at https://forum.arduino.cc/index.php?topic=214436.15 */
+uint8_t
+weather_chk(
+		const uint8_t *buff,
+		uint8_t length)
+{
+	uint8_t mask = 0x7C;
+	uint8_t checksum = 0x64;
+
+	for (uint8_t byteCnt = 0; byteCnt < length; byteCnt++) {
+		uint8_t data = buff[byteCnt];
+
+		for (int8_t bitCnt = 7; bitCnt >= 0; bitCnt--) {
+			// Rotate mask right
+			uint8_t bit = mask & 1;
+			mask = (mask >> 1) | (mask << 7);
+			if (bit)
+				mask ^= 0x18;
+			// XOR mask into checksum if data bit is 1
+			if (data & 0x80)
+				checksum ^= mask;
+			data <<= 1;
+		}
+	}
+	return checksum;
+}
+
+int
+weather_find(
+		msg_p m)
+{
+	if (m->bitcount < 64)
+		return -1;
+	/* idea here is to shift the header around to try to find the constant
+	 * header, and if found, we offset the whole buffer to match */
+	uint16_t *ml = (uint16_t*)m->msg;
+	int shift = 0;
+	for (int i = 0; i < 8; i++, shift++) {
+		uint32_t w = (ntohs(ml[0]) << (8 - shift)) |
+						(ntohs(ml[1]) >> (8 + shift));
+
+		if (w == 0x0145) {
+			// weather station message is shifted by that amount
+			msg_shift(m, shift);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Try the combinations of the bits the decoder wasn't sure of, keep the
+ * one that gets a valid checksum, if there is just the one.
+ */
+static int
+weather_repair(
+		msg_p m)
+{
+	unsigned found = 0;
+
+	if (!m->erased || m->erased > MSG_ERASE_MAX)
+		return -1;
+	for (unsigned mask = 1; mask < (1 << m->erased); mask++) {
+		msg_flip_erased(m, mask);
+		if (weather_chk(m->msg + 1, 5) == m->msg[6]) {
+			if (found) {
+				msg_flip_erased(m, mask);
+				return -1;
+			}
+			found = mask;
+		}
+		msg_flip_erased(m, mask);
+	}
+	if (!found)
+		return -1;
+	msg_flip_erased(m, found);
+	log_printf(log_Debug, "weather: repaired %d erased bits\n", m->erased);
+	return 0;
+}
+
+int
+weather_decode(
+		msg_p m,
+		weather_p w)
+{
+	uint8_t * msg = m->msg;
+	uint8_t chk = weather_chk(msg + 1, 5);
+
+	if (chk != msg[6] && weather_repair(m))
+		return -1;
+	w->temp = ((msg[3] & 0x7) << 8) | msg[4];
+	w->temp -= 400 + 320;
+	w->temp = (w->temp * 5) / 9;
+	if (msg[3] & 0x08) w->temp *= -1;
+	w->hum = msg[5];
+	w->bat = msg[3] & 0x80;
+	w->station = msg[2];
+	w->channel = (msg[3] >> 4) & 7;
+	return 0;
+}
+
+/*
+ * Search for 8 pulses of ~equal duration. Even manchester starts with
+ * at least 8 of them like that, while ASK will always be at least
+ * 8 bits anyway, so it's a good discriminant
+ */
+int
+pulse_sync_scalar(
+		const pulse_t * pulse,
+		size_t start,
+		size_t end,
+		pulse_sync_p s)
+{
+	size_t pi = start;
+	size_t syncstart = start;
+	uint8_t syncduration = 0;
+	uint8_t synclen = 0;
+	uint8_t manchester = 0;
+
+	while (pi != end && synclen < PULSE_SYNC_LEN) {
+		uint8_t d = pulse[pi][0] + pulse[pi][1];
+		if (d < PULSE_SYNC_MIN || abs_sub(d, syncduration) > 8) {
+			syncstart = pi;
+			syncduration = d;
+			synclen = 0;
+			manchester = 0;
+		} else {
+			if (abs_sub(pulse[pi][1], pulse[pi][0]) < 12)
+				manchester++;
+			else
+				manchester = 0;
+			if (debug_sync > 1)
+				log_printf(log_Debug, "sync %d delta %d/%d = %d\n", synclen,
+					syncduration, d, syncduration - d);
+			/* Integrate half the difference with previous cycle,
+			 * turns out some transmitter start a bit sluggish
+			 * and gradually get to 'speed' */
+			syncduration += (d - syncduration) / 2;
+			synclen++;
+		}
+		pi++;
+	}
+	s->start = syncstart;
+	s->end = pi;
+	s->duration = syncduration;
+	s->len = synclen;
+	s->manchester = manchester;
+	return synclen == PULSE_SYNC_LEN ? 0 : -1;
+}
+
+int
+pulse_sync(
+		const pulse_t * pulse,
+		size_t count,
+		pulse_sync_p s)
+{
+	size_t pi = 0, run_end;
+
+	memset(s, 0, sizeof(*s));
+	/* only run the scalar search where the kernel says it could succeed */
+	while ((pi = pulse_sync_scan(pulse, pi, count, &run_end)) < count) {
+		if (pulse_sync_scalar(pulse, pi, run_end, s) == 0)
+			return 0;
+		pi = run_end;
+	}
+	return -1;
+}
+
+void
+pulse_decoder(
+		msg_p m,
+		msg_p o)
+{
+	/* two bytes per pulse */
+	size_t end = m->bytecount / 2;
+	pulse_t *pulse = (pulse_t *)m->msg;
+	pulse_sync_t sync;
+
+	int res = pulse_sync(pulse, end, &sync);
+	if (debug_sync)
+		log_printf(log_Debug, "syncstart %d synclen = %d, manchester: %d\n",
+			(int)sync.start, sync.len, sync.manchester);
+	/* a sync that ends the pulse train is no good either */
+	if (res || sync.end == end) {
+		log_printf(log_Raw, "MN:%d\n", (int)end);
+		/* don't leave the caller with garbage */
+		msg_init(o, 'N');
+		o->decoded = 0;
+		return;
+	}
+	size_t pi;
+	size_t syncstart = sync.start;
+	uint8_t syncduration = sync.duration;
+	uint8_t synclen = sync.len;
+	uint8_t manchester = sync.manchester;
+
+	msg_init(o, manchester ? 'M' : 'A');
+	o->pulse_duration = syncduration;
+	o->decoded = 1;
+
+	if (!manchester) {
+		pi = syncstart;
+		while (pi != end) {
+			uint8_t bit = pulse[pi][1] > pulse[pi][0];
+			/* phases too close to call */
+			if (abs_sub(pulse[pi][1], pulse[pi][0]) < (syncduration / 8))
+				msg_erase(o);
+			msg_stuffbit(o, bit);
+			pi++;
+		}
+	} else {
+		// We know what a half pulse is, it's synclen / 2
+		pi = syncstart + (synclen - manchester);
+		if (synclen - manchester)
+			log_printf(log_Debug, "** Adjusted start %d huh %d\n", (int)pi,
+					synclen - manchester);
+		uint8_t bit = 0, phase = 1;
+		uint8_t demiclock = 0;
+		uint8_t stuffclock = 0;
+		/* clock recovery, same as the firmware; 1/16th of ticks */
+		uint16_t clock = (uint16_t)syncduration << 4;
+		const uint16_t clock_min = clock - (clock / 4);
+		uint16_t clock_max = clock + (clock / 4);
+		if (clock_max > (0xff << 4))
+			clock_max = 0xff << 4;
+
+		/*
+		 * Could demi-clocks; stuff the current bit value at each cycles,
+		 * and change the bit values when we get a phase that is more than
+		 * a demi synclen.
+		 */
+		while (pi != end) {
+			if (stuffclock != demiclock) {
+				if (stuffclock & 1)
+					msg_stuffbit(o, bit);
+				stuffclock++;
+			}
+			uint8_t d = pulse[pi][phase];
+			uint8_t sd = clock >> 4;
+			uint8_t margin = sd / 4;
+			int16_t err = 0;
+			// if the phase is double the demiclock, change polarity
+			if (abs_sub(d, sd) < margin) {
+				bit = phase;
+				demiclock++;
+				err = ((uint16_t)d << 4) - clock;
+			} else if (abs_sub(d, sd / 2) < margin)
+				err = ((uint16_t)d << 5) - clock;
+			else if (d < 0xff)
+				msg_erase(o);	// neither a demi clock nor a full one
+			if (err) {
+				clock += err / 8;
+				if (clock < clock_min)
+					clock = clock_min;
+				else if (clock > clock_max)
+					clock = clock_max;
+			}
+			demiclock++;
+			if (stuffclock != demiclock) {
+				if (stuffclock & 1)
+					msg_stuffbit(o, bit);
+				stuffclock++;
+			}
+
+			if (phase == 0) pi++;
+			phase = !phase;
+		}
+	}
+}
@@ -0,0 +1,86 @@
+/*
+ * decode.h
+ *
+ *  Created on: 17 Oct 2026
+ */
+
+#ifndef _DECODE_H_
+#define _DECODE_H_
+
+#include "msg.h"
+#include "pulse_simd.h"
+
+// overflow substraction for the counters
+static inline uint8_t ovf_sub(uint8_t v1, uint8_t v2) {
+	return v1 > v2 ? 255 - v1 + v2 : v2 - v1;
+}
+// absolute value substraction for durations etc
+static inline uint8_t abs_sub(uint8_t v1, uint8_t v2) {
+	return v1 > v2? v1 - v2 : v2 - v1;
+}
+
+/* Ambient Weather F007th decoded values */
+typedef struct weather_t {
+	int			temp;	// in 1/10th of celcius
+	uint8_t		hum, bat, station, channel;
+} weather_t, *weather_p;
+
+extern unsigned debug_sync;
+
+/* result of the sync search on a pulse train */
+typedef struct pulse_sync_t {
+	size_t			start;		// first pulse of the sync
+	size_t			end;		// first pulse after it
+	uint8_t			duration, len, manchester;
+} pulse_sync_t, *pulse_sync_p;
+
+/*
+ * Plain sync search over pulses 'start' to 'end', from a fresh state.
+ * Returns 0 if a sync was found.
+ */
+int
+pulse_sync_scalar(
+		const pulse_t * pulse,
+		size_t start,
+		size_t end,
+		pulse_sync_p s);
+
+/* same over a whole pulse train, but only where pulse_sync_scan() says */
+int
+pulse_sync(
+		const pulse_t * pulse,
+		size_t count,
+		pulse_sync_p s);
+
+/*
+ * Decode a raw 'MP' pulse message 'm' into an ASK or manchester
+ * message 'o'
+ */
+void
+pulse_decoder(
+		msg_p m,
+		msg_p o);
+
+uint8_t
+weather_chk(
+		const uint8_t *buff,
+		uint8_t length);
+
+/*
+ * Look for the weather sensor constant header in the first bits of 'm',
+ * if found, shift the buffer to align on it and return 0.
+ */
+int
+weather_find(
+		msg_p m);
+
+/*
+ * Decode an aligned weather message, return 0 if the checksum matched
+ * and 'w' was filled.
+ */
+int
+weather_decode(
+		msg_p m,
+		weather_p w);
+
+#endif /* _DECODE_H_ */
@@ -0,0 +1,111 @@
+/*
+ * discover.c
+ *
+ *  Created on: 17 Oct 2026
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "discover.h"
+#include "decode.h"
+
+static int
+discover_same(
+		msg_p a,
+		msg_p b)
+{
+	if (a->type != b->type || a->bitcount != b->bitcount)
+		return 0;
+	if (abs_sub(a->pulse_duration, b->pulse_duration) >
+			(a->pulse_duration / 8) + 1)
+		return 0;
+	return !memcmp(a->msg, b->msg, (a->bitcount + 7) / 8);
+}
+
+void
+discover_add(
+		discover_p d,
+		msg_p m,
+		uint64_t now)
+{
+	discover_slot_p s = NULL, min = NULL;
+
+	if (!m->bitcount || m->bitcount > 256)
+		return;
+	for (int i = 0; i < d->used && !s; i++) {
+		discover_slot_p c = &d->slot[i];
+		if (discover_same(&c->msg, m))
+			s = c;
+		else if (!min || c->count < min->count)
+			min = c;
+	}
+	if (s) {
+		if (now - s->last > DISCOVER_BURST_MS) {
+			s->count++;
+			d->frames++;
+		}
+		s->last = now;
+		return;
+	}
+	d->frames++;
+	if (d->used < DISCOVER_SLOTS) {
+		s = &d->slot[d->used++];
+		s->count = s->error = 0;
+	} else {
+		/* the new one takes over the smallest counter */
+		s = min;
+		s->error = s->count;
+	}
+	s->count++;
+	s->last = now;
+	memcpy(&s->msg, m, sizeof(msg_t) + ((m->bitcount + 7) / 8));
+	s->msg.bytecount = (m->bitcount + 7) / 8;
+	/* it's printed to go in a mapping file, that has no use for them */
+	s->msg.erased = 0;
+}
+
+static int
+discover_cmp(
+		const void * a,
+		const void * b)
+{
+	const discover_slot_t * sa = *(const discover_slot_t **)a;
+	const discover_slot_t * sb = *(const discover_slot_t **)b;
+	return sa->count > sb->count ? -1 : sa->count < sb->count;
+}
+
+int
+discover_report(
+		discover_p d,
+		int count,
+		char * dst,
+		size_t size)
+{
+	discover_slot_p top[DISCOVER_SLOTS];
+
+	for (int i = 0; i < d->used; i++)
+		top[i] = &d->slot[i];
+	qsort(top, d->used, sizeof(top[0]), discover_cmp);
+	if (count > d->used)
+		count = d->used;
+
+	int l = snprintf(dst, size, "{\"frames\":%u,\"top\":[", d->frames);
+	for (int i = 0; i < count && l < size; i++) {
+		char m[16 + (2 * 256 / 8) + 16];
+		msg_sprint(m, sizeof(m), &top[i]->msg, "");
+		/* so it can be pasted in a mapping file */
+		m[strcspn(m, "*\n")] = 0;
+		l += snprintf(dst + l, size - l, "%s{"
+				"\"msg\":\"%s\","
+				"\"count\":%u,"
+				"\"error\":%u,"
+				"\"last\":%llu"
+				"}",
+				i ? "," : "", m, top[i]->count, top[i]->error,
+				(unsigned long long)(top[i]->last / 1000));
+	}
+	if (l < size)
+		l += snprintf(dst + l, size - l, "]}");
+	return l;
+}
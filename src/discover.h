@@ -0,0 +1,63 @@
+/*
+ * discover.h
+ *
+ *  Created on: 17 Oct 2026
+ *
+ * What's out there that we don't know about. Frames that match no mapping
+ * are counted in a Space-Saving sketch: a fixed number of counters, a new
+ * frame takes over the smallest one (and inherits it's count, as the
+ * error). Whatever is heard more often than 1/DISCOVER_SLOTS of the
+ * unmatched traffic is guaranteed to be in there, with a count that is
+ * off by at most 'error'.
+ */
+
+#ifndef _DISCOVER_H_
+#define _DISCOVER_H_
+
+#include <stdint.h>
+#include "msg.h"
+
+#define DISCOVER_SLOTS		32
+/* how many are published */
+#define DISCOVER_TOP		10
+/* repeats of a frame within that window count as one */
+#define DISCOVER_BURST_MS	500
+#define DISCOVER_REPORT_MS	(5 * 60 * 1000)
+
+typedef struct discover_slot_t {
+	union {
+		msg_t		msg;
+		uint8_t		b[sizeof(msg_t) + (256/8)];
+	};
+	uint32_t		count, error;
+	uint64_t		last;		// gettime_ms() when last heard
+} discover_slot_t, *discover_slot_p;
+
+typedef struct discover_t {
+	uint32_t		frames;		// unmatched, total
+	int				used;
+	discover_slot_t	slot[DISCOVER_SLOTS];
+} discover_t, *discover_p;
+
+/*
+ * Count frame 'm'; it's keyed on the type, bit count, payload and the
+ * pulse duration, give or take 1/8th
+ */
+void
+discover_add(
+		discover_p d,
+		msg_p m,
+		uint64_t now);
+
+/*
+ * Format the top 'count' frames as JSON in 'dst', returns the length like
+ * snprintf()
+ */
+int
+discover_report(
+		discover_p d,
+		int count,
+		char * dst,
+		size_t size);
+
+#endif /* _DISCOVER_H_ */
@@ -0,0 +1,553 @@
+/*
+ * fw_decode.c
+ *
+ *  Created on: 17 Oct 2026
+ *
+ * The decoders here are straight ports of the coroutines in
+ * avr/rf_bridge_common.c; instead of yielding for more pulses they see the
+ * whole pulse train at once, and the end of it counts as the end of the
+ * message. Keep them in sync with the firmware!
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fw_decode.h"
+#include "decode.h"
+
+enum {
+	fw_ASK = 0,
+	fw_OOK,
+	fw_Manchester,
+	fw_Fixed,
+	fw_Distance,
+};
+
+static void
+fw_sampler_grow(
+		fw_sampler_p s)
+{
+	if (s->count + 1 < s->size)
+		return;
+	s->size = s->size ? s->size * 2 : 1024;
+	s->pulse = realloc(s->pulse, s->size * sizeof(s->pulse[0]));
+	s->stamp = realloc(s->stamp, s->size * sizeof(s->stamp[0]));
+}
+
+void
+fw_sampler_init(
+		fw_sampler_p s,
+		uint64_t time)
+{
+	memset(s, 0, sizeof(*s));
+	s->time = time;
+	fw_sampler_grow(s);
+	s->pulse[0][0] = s->pulse[0][1] = 0;
+	s->stamp[0] = time;
+}
+
+/* 'n' samples of level 'b', the ISR would have run 'n' times */
+static void
+fw_sample(
+		fw_sampler_p s,
+		uint8_t b,
+		uint64_t n)
+{
+	if (!n)
+		return;
+	uint8_t * p = s->pulse[s->count];
+	/* the first sample is the only one that can be an edge */
+	if (p[b] < FW_MAX_TICKS)
+		p[b]++;
+	if (!s->bit && b) {
+		if (p[0] > FW_GLITCH_TICKS || p[1] > FW_GLITCH_TICKS) {
+			s->count++;
+			fw_sampler_grow(s);
+		}
+		p = s->pulse[s->count];
+		p[0] = p[1] = 0;
+		s->stamp[s->count] = s->time;
+	}
+	s->bit = b;
+	n--;
+	p[b] = p[b] + n > FW_MAX_TICKS ? FW_MAX_TICKS : p[b] + n;
+}
+
+void
+fw_sampler_edge(
+		fw_sampler_p s,
+		uint64_t time,
+		uint8_t level)
+{
+	if (time < s->time)
+		time = s->time;
+	/* samples happen at fixed times, count the ones in [s->time, time) */
+	uint64_t n = ((time + FW_TICK_NS - 1) / FW_TICK_NS) -
+			((s->time + FW_TICK_NS - 1) / FW_TICK_NS);
+	fw_sample(s, s->level, n);
+	s->time = time;
+	s->level = level;
+}
+
+void
+fw_sampler_flush(
+		fw_sampler_p s)
+{
+	fw_sampler_edge(s, s->time, 0);
+	fw_sample(s, 0, FW_MAX_TICKS);
+	uint8_t * p = s->pulse[s->count];
+	if (p[0] > FW_GLITCH_TICKS || p[1] > FW_GLITCH_TICKS) {
+		s->count++;
+		fw_sampler_grow(s);
+		s->pulse[s->count][0] = s->pulse[s->count][1] = 0;
+	}
+}
+
+void
+fw_sampler_free(
+		fw_sampler_p s)
+{
+	free(s->pulse);
+	free(s->stamp);
+	s->pulse = NULL;
+	s->stamp = NULL;
+	s->count = s->size = 0;
+}
+
+static void
+fw_out(
+		fw_decoder_p d,
+		const char * s)
+{
+	int l = strlen(s);
+	if (d->len + l < sizeof(d->line)) {
+		memcpy(d->line + d->len, s, l + 1);
+		d->len += l;
+	}
+}
+
+static void
+fw_stuffbit(
+		fw_decoder_p d,
+		uint8_t b,
+		uint8_t last)
+{
+	uint8_t bn = d->bcount % 8;
+	d->byte |= b << (7 - bn);
+	d->bcount++;
+	if (last || bn == 7) {
+		char h[3];
+		d->chk += d->byte;
+		sprintf(h, "%02x", d->byte);
+		fw_out(d, h);
+		d->byte = 0;
+	}
+}
+
+static void
+fw_erasebit(
+		fw_decoder_p d)
+{
+	/* the indexes are 8 bits, like the firmware's; hopeless past that */
+	if (d->bcount > 0xff) {
+		d->erased = FW_ERASE_MAX + 1;
+		return;
+	}
+	if (d->erased < FW_ERASE_MAX)
+		d->erase[d->erased] = d->bcount;
+	if (d->erased <= FW_ERASE_MAX)
+		d->erased++;
+}
+
+/* is 'pi' the end of the message, a long silence (or the end of data) */
+static inline uint8_t
+fw_end(
+		fw_decoder_p d,
+		size_t pi)
+{
+	return d->pulse[pi][0] >= FW_MAX_TICKS || pi + 1 == d->count;
+}
+
+/*
+ * These return where the sync search should restart, and set 'done' if
+ * a message was output
+ */
+static size_t
+fw_decode_ask(
+		fw_decoder_p d,
+		size_t pi,
+		int * done)
+{
+	size_t start = pi;
+	uint8_t pcount = 0;
+
+	while (pcount < 20 && pi < d->count) {
+		uint8_t s = d->pulse[pi][0] + d->pulse[pi][1];
+		if (abs_sub(s, d->syncduration) <= 8) {
+			pcount++;
+			pi++;
+		} else
+			break;
+	}
+	if (pcount < 20) {
+		d->decoded = 0;
+		return pi;
+	}
+	pi = start;
+	d->decoded = 1;
+	fw_out(d, "MA:");
+	uint8_t end = 0;
+	while (!end && pi < d->count) {
+		uint8_t b = d->pulse[pi][1] > d->pulse[pi][0];
+		end = fw_end(d, pi);
+		if (abs_sub(d->pulse[pi][1], d->pulse[pi][0]) < (d->syncduration / 8))
+			fw_erasebit(d);
+		fw_stuffbit(d, b, end);
+		pi++;
+	}
+	*done = 1;
+	return pi;
+}
+
+static size_t
+fw_decode_ook(
+		fw_decoder_p d,
+		size_t pi,
+		int * done)
+{
+	size_t start = pi;
+	uint8_t pcount = 0;
+	uint8_t sd = d->syncduration;
+	uint8_t margin = sd / 8;
+
+	while (pcount < 20 && pi < d->count) {
+		const uint8_t * p = d->pulse[pi];
+		if (abs_sub(p[0], sd) <= margin || abs_sub(p[1], sd) <= margin ||
+				abs_sub(p[0], sd / 2) <= margin ||
+				abs_sub(p[1], sd / 2) <= margin) {
+			pcount++;
+			pi++;
+		} else
+			break;
+	}
+	if (pcount < 20) {
+		d->decoded = 0;
+		return pi;
+	}
+	pi = start;
+	d->decoded = 1;
+	fw_out(d, "MO:");
+	uint8_t end = 0;
+	while (!end && pi < d->count) {
+		const uint8_t * p = d->pulse[pi];
+		end = fw_end(d, pi);
+		if (abs_sub(p[0], sd) <= margin)
+			fw_stuffbit(d, 0, end);
+		if (abs_sub(p[1], sd) <= margin)
+			fw_stuffbit(d, 1, end);
+		pi++;
+	}
+	*done = 1;
+	return pi;
+}
+
+/*
+ * The firmware decoder keeps up with the pulses as they arrive, so the
+ * bit count cap is checked about every pulse; we do the same.
+ */
+static size_t
+fw_decode_manchester(
+		fw_decoder_p d,
+		size_t pi,
+		int * done)
+{
+	size_t start = pi;
+	uint8_t pcount = 0;
+	uint8_t sd = d->syncduration;
+	uint8_t margin = sd / 4;
+
+	while (pcount < 32 && pi < d->count) {
+		const uint8_t * p = d->pulse[pi];
+		if (abs_sub(p[0], sd) <= margin || abs_sub(p[1], sd) <= margin ||
+				abs_sub(p[0], sd / 2) <= margin ||
+				abs_sub(p[1], sd / 2) <= margin) {
+			pcount++;
+			pi++;
+		} else
+			break;
+	}
+	if (pcount < 32) {
+		d->decoded = 0;
+		return pi;
+	}
+	pi = start;
+	d->decoded = 1;
+	fw_out(d, "MM:");
+	uint8_t bit = 0, phase = 1;
+	uint8_t demiclock = 0, stuffclock = 0;
+	uint8_t end = 0;
+	uint16_t clock = (uint16_t)sd << 4;
+	const uint16_t clock_min = clock - (clock / 4);
+	uint16_t clock_max = clock + (clock / 4);
+	if (clock_max > (FW_MAX_TICKS << 4))
+		clock_max = FW_MAX_TICKS << 4;
+
+	while (!end && d->bcount < FW_BCOUNT_MAX && pi < d->count) {
+		end = fw_end(d, pi);
+
+		if (stuffclock != demiclock) {
+			if (stuffclock & 1)
+				fw_stuffbit(d, bit, end);
+			stuffclock++;
+		}
+		uint8_t ph = d->pulse[pi][phase];
+		int16_t err = 0;
+		sd = clock >> 4;
+		margin = sd / 4;
+		if (abs_sub(ph, sd) < margin) {
+			bit = phase;
+			demiclock++;
+			err = ((uint16_t)ph << 4) - clock;
+		} else if (abs_sub(ph, sd / 2) < margin)
+			err = ((uint16_t)ph << 5) - clock;
+		else if (ph < FW_MAX_TICKS)
+			fw_erasebit(d);
+		if (err) {
+			clock += err / 8;
+			if (clock < clock_min)
+				clock = clock_min;
+			else if (clock > clock_max)
+				clock = clock_max;
+		}
+		demiclock++;
+		if (stuffclock != demiclock) {
+			if (stuffclock & 1)
+				fw_stuffbit(d, bit, end);
+			stuffclock++;
+		}
+		if (phase == 0) pi++;
+		phase = !phase;
+	}
+	*done = 1;
+	return pi;
+}
+
+/* PT2262/EV1527 PWM, or pulse distance; checked first, then output */
+static size_t
+fw_decode_fixed(
+		fw_decoder_p d,
+		size_t pi,
+		uint8_t distance,
+		int * done)
+{
+	size_t start = pi;
+	uint8_t bits = 0, ok = 1;
+	uint8_t tristate = 1, floats = 0, last = 0;
+	uint8_t lo = FW_MAX_TICKS, hi = 0;
+	uint8_t sd = d->syncduration, tol = sd / 8;
+	uint8_t mark = pi < d->count ? d->pulse[pi][1] : 0;
+
+	do {
+		if (pi >= d->count)
+			break;
+		uint8_t p0 = d->pulse[pi][0], p1 = d->pulse[pi][1];
+		if (p0 >= FW_MAX_TICKS)
+			break;
+		if (distance) {
+			ok = abs_sub(p1, mark) <= mark / 4 && p0 >= p1 - (p1 / 4);
+			if (p0 < lo)
+				lo = p0;
+			if (p0 > hi)
+				hi = p0;
+		} else {
+			uint16_t s = p0 + p1;
+			uint8_t m = p0 < p1 ? p0 : p1;
+			uint8_t b = p1 > p0;
+			ok = s <= sd + tol && s + tol >= sd && m * 3 <= s && m * 5 >= s;
+			if (bits & 1) {
+				if (last && !b)
+					tristate = 0;
+				else if (!last && b)
+					floats++;
+			}
+			last = b;
+		}
+		bits++;
+		pi++;
+	} while (ok && bits <= FW_FIXED_MAX_BITS);
+
+	if (!ok || bits < FW_FIXED_MIN_BITS || bits > FW_FIXED_MAX_BITS ||
+			(distance && hi <= lo + (lo / 2))) {
+		d->decoded = 0;
+		return pi;
+	}
+	d->decoded = 1;
+	if (distance)
+		d->syncduration = mark;
+	fw_out(d, distance ? "MD:" :
+			tristate && floats && bits == 24 ? "MT:" : "ME:");
+	uint8_t threshold = lo + ((hi - lo) / 2);
+	pi = start;
+	for (uint8_t i = 0; i < bits; i++, pi++) {
+		uint8_t b;
+		if (distance) {
+			b = d->pulse[pi][0] > threshold;
+			if (abs_sub(d->pulse[pi][0], threshold) < (hi - lo) / 8)
+				fw_erasebit(d);
+		} else
+			b = d->pulse[pi][1] > d->pulse[pi][0];
+		fw_stuffbit(d, b, i == bits - 1);
+	}
+	*done = 1;
+	return pi + 1;
+}
+
+static int
+fw_sync_decoder(
+		fw_decoder_p d,
+		uint8_t pwm,
+		uint8_t manchester)
+{
+	if (pwm >= FW_SYNC_LEN - 1)
+		return fw_Fixed;
+	if (d->syncduration > 0x80)
+		return fw_OOK;
+	return manchester > 4 ? fw_Manchester : fw_ASK;
+}
+
+void
+fw_decode(
+		fw_decoder_p d)
+{
+	size_t pi = 0, syncstart = 0;
+	uint8_t synclen = 0, manchester = 0, pwm = 0;
+	size_t markstart = 0;
+	uint8_t marks = 0, mark = 0, space_lo = 0, space_hi = 0;
+
+	d->syncduration = 0;
+	while (pi < d->count) {
+		uint8_t spaced = 0;
+		while (pi < d->count && synclen < FW_SYNC_LEN && !spaced) {
+			uint8_t p0 = d->pulse[pi][0], p1 = d->pulse[pi][1];
+			uint16_t s = p0 + p1;
+
+			uint8_t dist = p1 >= 0x10 && p0 < FW_MAX_TICKS &&
+					p0 >= p1 - (p1 / 4);
+			if (dist && abs_sub(p1, mark) <= (mark / 8)) {
+				if (p0 < space_lo)
+					space_lo = p0;
+				if (p0 > space_hi)
+					space_hi = p0;
+				marks++;
+				spaced = marks >= FW_SYNC_LEN &&
+							space_hi > space_lo + (space_lo / 2);
+			} else {
+				markstart = pi;
+				mark = dist ? p1 : 0;
+				space_lo = space_hi = p0;
+				marks = 0;
+			}
+
+			if (s > 0x70) {
+				if (abs_sub(p0 / 2, p1) < (s / 8)) {
+					p0 /= 2;
+					s = p0 + p1;
+				} else if (abs_sub(p0, p1 / 2) < (s / 8)) {
+					p1 /= 2;
+					s = p0 + p1;
+				} else if (abs_sub(s / 2, d->syncduration) < (s / 16)) {
+					p1 /= 2; p0 /= 2;
+					s /= 2;
+				}
+			}
+			if (s < 0x20 || abs_sub(s, d->syncduration) > 8) {
+				syncstart = pi;
+				d->syncduration = s;
+				synclen = 0;
+				manchester = 0;
+				pwm = 0;
+			} else {
+				uint8_t m = p0 < p1 ? p0 : p1;
+				if (abs_sub(p1, p0) < (s / 8))
+					manchester++;
+				else if (m * 3 <= s && m * 5 >= s)
+					pwm++;
+				d->syncduration += (s - d->syncduration) / 2;
+				synclen++;
+			}
+			pi++;
+		}
+		if (synclen < FW_SYNC_LEN && !spaced)
+			break;
+		if (synclen < FW_SYNC_LEN)
+			syncstart = markstart;
+
+		int state = marks >= FW_SYNC_LEN ? fw_Distance :
+				fw_sync_decoder(d, pwm, manchester);
+		size_t msg_start;
+		do {
+			int done = 0;
+			msg_start = state == fw_Distance ? markstart : syncstart;
+			d->chk = 0x55;
+			d->bcount = d->byte = d->decoded = d->erased = 0;
+			d->len = 0;
+			d->line[0] = 0;
+			switch (state) {
+				case fw_ASK:
+					msg_start = fw_decode_ask(d, msg_start, &done);
+					break;
+				case fw_OOK:
+					msg_start = fw_decode_ook(d, msg_start, &done);
+					break;
+				case fw_Manchester:
+					msg_start = fw_decode_manchester(d, msg_start, &done);
+					break;
+				case fw_Fixed:
+				case fw_Distance:
+					msg_start = fw_decode_fixed(d, msg_start,
+							state == fw_Distance, &done);
+					break;
+			}
+			if (done) {
+				char tail[16];
+				if (d->erased > FW_ERASE_MAX)
+					fw_out(d, "?ff");
+				else for (int i = 0; i < d->erased; i++) {
+					sprintf(tail, "?%02x", d->erase[i]);
+					fw_out(d, tail);
+				}
+				d->chk += d->bcount;
+				d->chk += d->syncduration;
+				if (d->bcount > 0xff) {
+					d->chk += d->bcount >> 8;
+					sprintf(tail, "&%04x!%0x*%02x", d->bcount,
+							d->syncduration, d->chk);
+				} else
+					sprintf(tail, "#%02x!%0x*%02x", d->bcount,
+							d->syncduration, d->chk);
+				fw_out(d, tail);
+				if (d->bcount && d->frame)
+					d->frame(d, syncstart, msg_start, d->line);
+			}
+			if (state == fw_Distance && !d->decoded &&
+					synclen == FW_SYNC_LEN)
+				state = fw_sync_decoder(d, pwm, manchester);
+			/* not a fixed code, it can still be plain ASK, or OOK */
+			else if (state == fw_Fixed && !d->decoded)
+				state = d->syncduration > 0x80 ? fw_OOK : fw_ASK;
+			/* ASK is strict, try manchester if there was a chance */
+			else if (state == fw_ASK && manchester && !d->decoded)
+				state = fw_Manchester;
+			else
+				break;
+		} while (1);
+		synclen = manchester = pwm = d->syncduration = 0;
+		marks = mark = 0;
+		/* a decoder can fail right on the sync start, move past it */
+		if (!d->decoded &&
+				(msg_start == syncstart || msg_start == markstart))
+			msg_start = syncstart + 1;
+		pi = msg_start;
+		syncstart = pi + 1;
+	}
+}
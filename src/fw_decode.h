@@ -0,0 +1,103 @@
+/*
+ * fw_decode.h
+ *
+ *  Created on: 17 Oct 2026
+ *
+ * Host model of the firmware receiver; the TIMER0_COMPA sampling that
+ * turns edges into pulses, the sync search and the ASK, OOK, manchester
+ * and fixed code decoders. Same thresholds, same 8 bits arithmetic, so it
+ * outputs the same lines the firmware would for the same signal. Used to
+ * analyse logic analyser captures offline.
+ */
+
+#ifndef _FW_DECODE_H_
+#define _FW_DECODE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* receiver sampling period, 16Mhz / 8 / 31 */
+#define FW_TICK_NS			15500
+#define FW_MAX_TICKS		255
+/* pulses with both phases shorter than that are glitches */
+#define FW_GLITCH_TICKS		20
+#define FW_SYNC_LEN			8
+/* fixed code (PWM and pulse distance) frame lengths */
+#define FW_FIXED_MIN_BITS	20
+#define FW_FIXED_MAX_BITS	64
+/* bits with their timing off, sent as '?xx' */
+#define FW_ERASE_MAX		6
+/*
+ * This models the mega build, with 16 bits bit counts; frames longer than
+ * 255 bits end with '&xxxx'. Lines are cut at FW_LINE_BITS bits.
+ */
+#define FW_BCOUNT_MAX		0xff00
+#define FW_LINE_BITS		1024
+#define FW_LINE_SIZE		(16 + (2 * FW_LINE_BITS / 8) + \
+								(3 * (FW_ERASE_MAX + 1)) + 16)
+
+typedef uint8_t fw_pulse_t[2];	// [0] low phase, [1] high phase, in ticks
+
+/*
+ * Turns edges into pulses, like the ISR does. 'pulse' and 'stamp' (ns,
+ * of the edge that started each pulse) grow as needed, 'count' is the
+ * number of finished pulses.
+ */
+typedef struct fw_sampler_t {
+	uint64_t		time;		// ns, of the last edge
+	uint8_t			level;		// since the last edge
+	uint8_t			bit;		// last sampled level
+	size_t			count, size;
+	fw_pulse_t *	pulse;
+	uint64_t *		stamp;
+} fw_sampler_t, *fw_sampler_p;
+
+void
+fw_sampler_init(
+		fw_sampler_p s,
+		uint64_t time);
+
+/* the input changed to 'level' at 'time' ns */
+void
+fw_sampler_edge(
+		fw_sampler_p s,
+		uint64_t time,
+		uint8_t level);
+
+/* end of the input; finish with a silence, so the last frame ends */
+void
+fw_sampler_flush(
+		fw_sampler_p s);
+
+void
+fw_sampler_free(
+		fw_sampler_p s);
+
+struct fw_decoder_t;
+
+/* called with every frame line, and the pulses it was decoded from */
+typedef void (*fw_frame_p)(
+		struct fw_decoder_t * d,
+		size_t start,
+		size_t end,
+		const char * line);
+
+typedef struct fw_decoder_t {
+	const fw_pulse_t *	pulse;
+	size_t				count;
+	fw_frame_p			frame;
+	void *				param;
+	/* these are the firmware globals */
+	uint8_t				syncduration, chk, byte, decoded;
+	uint16_t			bcount;
+	uint8_t				erased, erase[FW_ERASE_MAX];
+	int					len;
+	char				line[FW_LINE_SIZE];
+} fw_decoder_t, *fw_decoder_p;
+
+/* run the sync search and decoders over all the pulses */
+void
+fw_decode(
+		fw_decoder_p d);
+
+#endif /* _FW_DECODE_H_ */
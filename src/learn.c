@@ -0,0 +1,420 @@
+/*
+ * learn.c
+ *
+ *  Created on: 17 Oct 2026
+ *
+ * Pulses here are in the host 'MP' layout; [0] is the high phase, [1] the
+ * low one, in firmware ticks.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "learn.h"
+#include "decode.h"
+#include "fw_decode.h"
+
+void
+learn_init(
+		learn_p l,
+		unsigned repeats)
+{
+	memset(l, 0, sizeof(*l));
+	l->repeats = repeats ? repeats : 1;
+}
+
+const char *
+learn_encoding_name(
+		uint8_t encoding)
+{
+	static const char * names[] = {
+		[learn_Unknown] = "unknown",
+		[learn_PWM] = "pwm",
+		[learn_Manchester] = "manchester",
+		[learn_OOK] = "ook",
+	};
+	return encoding <= learn_OOK ? names[encoding] : names[learn_Unknown];
+}
+
+static inline int
+learn_nearest(
+		const uint8_t * center,
+		int k,
+		uint8_t d)
+{
+	int c = 0;
+	while (c < k - 1 && d * 2 > center[c] + center[c + 1])
+		c++;
+	return c;
+}
+
+uint64_t
+learn_kmeans(
+		const uint32_t * hist,
+		int k,
+		uint8_t * center,
+		uint32_t * weight)
+{
+	uint64_t total = 0;
+	for (int b = 0; b < 256; b++)
+		total += hist[b];
+	if (!total)
+		return 0;
+	/*
+	 * Start on the median, then add the bins that are the worst explained
+	 * so far; quantiles get stuck when a symbol length is rare
+	 */
+	uint64_t cum = 0;
+	int b = 0;
+	while (b < 255 && (cum + hist[b]) * 2 < total)
+		cum += hist[b++];
+	center[0] = b;
+	for (int n = 1; n < k; n++) {
+		uint64_t worst = 0;
+		int at = -1;
+		for (b = 0; b < 256; b++) {
+			int c = learn_nearest(center, n, b);
+			int d = b - center[c];
+			uint64_t e = (uint64_t)(d * d) * hist[b];
+			if (e > worst) {
+				worst = e;
+				at = b;
+			}
+		}
+		if (at < 0) {
+			/* nothing left to explain, empty clusters */
+			for (; n < k; n++)
+				center[n] = center[n - 1];
+			break;
+		}
+		/* keep them sorted */
+		int i = n;
+		while (i > 0 && center[i - 1] > at) {
+			center[i] = center[i - 1];
+			i--;
+		}
+		center[i] = at;
+	}
+	for (int iter = 0; iter < 16; iter++) {
+		uint64_t sum[LEARN_MAX_K] = {0};
+		uint32_t w[LEARN_MAX_K] = {0};
+		int c = 0;
+		for (int b = 0; b < 256; b++) {
+			if (!hist[b])
+				continue;
+			/* sorted centers, the boundaries are half way */
+			while (c < k - 1 && b * 2 > center[c] + center[c + 1])
+				c++;
+			sum[c] += (uint64_t)b * hist[b];
+			w[c] += hist[b];
+		}
+		int changed = 0;
+		for (c = 0; c < k; c++) {
+			weight[c] = w[c];
+			if (!w[c])
+				continue;
+			uint8_t n = (sum[c] + (w[c] / 2)) / w[c];
+			changed |= n != center[c];
+			center[c] = n;
+		}
+		if (!changed)
+			break;
+	}
+	uint64_t cost = 0;
+	for (int b = 0, c = 0; b < 256; b++) {
+		while (c < k - 1 && b * 2 > center[c] + center[c + 1])
+			c++;
+		int d = b - center[c];
+		cost += (uint64_t)(d * d) * hist[b];
+	}
+	return cost;
+}
+
+/*
+ * Pick the number of symbol lengths; one more is only worth it if it
+ * explains most of what is left, is a real symbol (not a handful of
+ * glitches), and is a different length altogether, not jitter.
+ */
+static int
+learn_cluster(
+		const uint32_t * hist,
+		uint8_t * center,
+		uint32_t * weight)
+{
+	uint8_t c[LEARN_MAX_K];
+	uint32_t w[LEARN_MAX_K];
+	uint64_t cost = learn_kmeans(hist, 1, center, weight);
+	int k = 1;
+
+	for (int n = 2; n <= LEARN_MAX_K && cost; n++) {
+		uint64_t nc = learn_kmeans(hist, n, c, w);
+		if (nc * 4 > cost)
+			break;
+		uint32_t total = 0;
+		for (int i = 0; i < n; i++)
+			total += w[i];
+		int ok = 1;
+		for (int i = 0; i < n && ok; i++) {
+			if (w[i] * 32 < total)
+				ok = 0;
+			if (i && c[i] * 5 < c[i - 1] * 7)
+				ok = 0;
+		}
+		if (!ok)
+			break;
+		k = n;
+		cost = nc;
+		memcpy(center, c, n);
+		memcpy(weight, w, n * sizeof(w[0]));
+	}
+	return k;
+}
+
+/* is 'd' a phase of the frame, not empty, and not the final silence */
+static inline int
+learn_phase(
+		uint8_t d)
+{
+	return d && d < FW_MAX_TICKS;
+}
+
+/*
+ * Work out the encoding from the clusters and how they pair up in pulses;
+ * 'unit' is the symbol length the phases are multiples of.
+ */
+static uint8_t
+learn_classify(
+		const pulse_t * pulse,
+		size_t count,
+		int k,
+		const uint8_t * center,
+		uint8_t * unit)
+{
+	unsigned pulses = 0, pwm = 0, shorts = 0;
+
+	if (k < 2)
+		return learn_Unknown;
+	for (size_t i = 0; i < count; i++) {
+		if (!learn_phase(pulse[i][0]) || !learn_phase(pulse[i][1]))
+			continue;
+		int s0 = learn_nearest(center, k, pulse[i][0]) == 0;
+		int s1 = learn_nearest(center, k, pulse[i][1]) == 0;
+		pulses++;
+		pwm += s0 != s1;
+		shorts += s0 && s1;
+	}
+	if (pulses < PULSE_SYNC_LEN)
+		return learn_Unknown;
+	/* a third cluster can be a sync or a gap, it doesn't matter here */
+	if (pwm * 10 >= pulses * 9) {
+		*unit = center[0];
+		return learn_PWM;
+	}
+	/* phases are one or two half bits, and there are both */
+	if (k == 2 && shorts &&
+			center[1] * 8 >= center[0] * 14 && center[1] * 8 <= center[0] * 18) {
+		*unit = (center[0] + (center[1] / 2) + 1) / 2;
+		return learn_Manchester;
+	}
+	/* NRZ; every symbol length is a multiple of the bit period */
+	for (int i = 1; i < k; i++) {
+		int n = (center[i] + (center[0] / 2)) / center[0];
+		int d = center[i] - (n * center[0]);
+		if ((d < 0 ? -d : d) > (n * center[0]) / 8)
+			return learn_Unknown;
+	}
+	*unit = center[0];
+	return learn_OOK;
+}
+
+static uint16_t
+learn_period(
+		uint8_t encoding,
+		const uint8_t * center)
+{
+	switch (encoding) {
+		case learn_PWM:
+			return center[0] + center[1];
+		case learn_Manchester:
+			return center[0] + (center[1] / 2);
+		default:
+			return center[0];
+	}
+}
+
+static inline void
+learn_key_bit(
+		learn_slot_p s,
+		uint8_t b)
+{
+	if (s->units < LEARN_KEY_BITS)
+		s->key[s->units / 8] |= b << (7 - (s->units % 8));
+	if (s->units < 0xffff)
+		s->units++;
+}
+
+/*
+ * What we compare frames on; for PWM, the bits the firmware would see,
+ * otherwise the levels, one per symbol unit
+ */
+static void
+learn_key(
+		learn_slot_p s,
+		const pulse_t * pulse,
+		size_t count,
+		uint8_t unit)
+{
+	memset(s->key, 0, sizeof(s->key));
+	s->units = 0;
+	if (s->encoding == learn_PWM) {
+		for (size_t i = 0; i < count; i++)
+			learn_key_bit(s, pulse[i][0] > pulse[i][1]);
+		s->bits = count;
+		return;
+	}
+	for (size_t i = 0; i < count; i++) {
+		for (int ph = 0; ph < 2; ph++) {
+			uint8_t d = pulse[i][ph];
+			if (!d)
+				continue;
+			if (d >= FW_MAX_TICKS)
+				goto done;
+			int n = (d + (unit / 2)) / unit;
+			n = n < 1 ? 1 : n > 8 ? 8 : n;
+			while (n--)
+				learn_key_bit(s, !ph);
+		}
+	}
+done:
+	s->bits = s->encoding == learn_Manchester ? s->units / 2 : s->units;
+}
+
+/* keep the first frame the firmware decoders would have sent */
+static void
+learn_fw_frame(
+		struct fw_decoder_t * d,
+		size_t start,
+		size_t end,
+		const char * line)
+{
+	learn_result_p r = d->param;
+	if (!r->line[0])
+		snprintf(r->line, sizeof(r->line), "%s", line);
+}
+
+static void
+learn_report(
+		learn_slot_p s,
+		const pulse_t * pulse,
+		size_t count,
+		learn_result_p r)
+{
+	memset(r, 0, sizeof(*r));
+	r->encoding = s->encoding;
+	r->k = s->k;
+	learn_kmeans(s->hist, s->k, r->center, r->weight);
+	r->period = learn_period(s->encoding, r->center);
+	r->period_us = (r->period * FW_TICK_NS) / 1000;
+	r->bits = s->bits;
+	r->repeats = s->hits;
+
+	/* the firmware has the phases the other way around */
+	fw_pulse_t fw[count];
+	for (size_t i = 0; i < count; i++) {
+		fw[i][0] = pulse[i][1];
+		fw[i][1] = pulse[i][0];
+	}
+	fw_decoder_t d = {
+		.pulse = fw,
+		.count = count,
+		.frame = learn_fw_frame,
+		.param = r,
+	};
+	fw_decode(&d);
+}
+
+int
+learn_frame(
+		learn_p l,
+		msg_p m,
+		uint64_t now,
+		learn_result_p res)
+{
+	if (!m->pulses)
+		return 0;
+	size_t count = m->bytecount / 2;
+	const pulse_t * pulse = (const pulse_t *)m->msg;
+	uint32_t hist[256] = {0};
+
+	for (size_t i = 0; i < count; i++)
+		for (int ph = 0; ph < 2; ph++)
+			if (learn_phase(pulse[i][ph]))
+				hist[pulse[i][ph]]++;
+	l->frames++;
+
+	uint8_t center[LEARN_MAX_K], unit = 0;
+	uint32_t weight[LEARN_MAX_K];
+	int k = learn_cluster(hist, center, weight);
+	uint8_t encoding = learn_classify(pulse, count, k, center, &unit);
+	if (encoding == learn_Unknown || !unit) {
+		l->unknown++;
+		return 0;
+	}
+	learn_slot_t f = { .encoding = encoding };
+	learn_key(&f, pulse, count, unit);
+
+	learn_slot_p s = NULL, victim = NULL;
+	for (int i = 0; i < LEARN_SLOTS && !s; i++) {
+		learn_slot_p c = &l->slot[i];
+		if (c->hits && now - c->last > LEARN_STALE_MS)
+			c->hits = 0;
+		if (c->hits && c->encoding == f.encoding && c->units == f.units &&
+				!memcmp(c->key, f.key, sizeof(f.key)))
+			s = c;
+		else if (!victim || c->hits < victim->hits ||
+				(c->hits == victim->hits && c->last < victim->last))
+			victim = c;
+	}
+	if (!s) {
+		/* recycle the least seen one, it's probably noise anyway */
+		s = victim;
+		memset(s, 0, sizeof(*s));
+		s->encoding = f.encoding;
+		s->k = k;
+		s->units = f.units;
+		s->bits = f.bits;
+		memcpy(s->key, f.key, sizeof(f.key));
+	}
+	s->hits++;
+	s->last = now;
+	for (int b = 0; b < 256; b++)
+		s->hist[b] += hist[b];
+	if (s->reported || s->hits < l->repeats)
+		return 0;
+	s->reported = 1;
+	learn_report(s, pulse, count, res);
+	return 1;
+}
+
+int
+learn_mapping(
+		learn_result_p r,
+		char * dst,
+		size_t size)
+{
+	msg_full_t u;
+
+	if (!r->line[0] || msg_parse(&u.m, MSG_MAX_BYTES, r->line) != 0)
+		return 0;
+	/* that's all the mapping file knows about */
+	if (!strchr("AMETD", u.m.type))
+		return 0;
+	/* the decoder wasn't sure of some bits, that's no mapping */
+	if (u.m.erased)
+		return 0;
+	int l = msg_sprint(dst, size, &u.m, "");
+	/* the mapping files don't bother with the checksum */
+	if (l >= size)
+		return 0;
+	dst[strcspn(dst, "*\n")] = 0;
+	return strlen(dst);
+}
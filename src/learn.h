@@ -0,0 +1,108 @@
+/*
+ * learn.h
+ *
+ *  Created on: 17 Oct 2026
+ *
+ * Learning mode; with the firmware in PULSE mode, every raw 'MP' frame is
+ * fed here. The phase durations are clustered (k-means, 1 to 3 symbol
+ * lengths), the encoding and bit period inferred from the clusters, and
+ * frames that look the same are counted. Once a frame was seen 'repeats'
+ * times it's reported, with the mapping line the firmware decoders would
+ * produce for it, if any.
+ * Memory is bounded, a handful of candidate frames are tracked at a time,
+ * so it can stay enabled on a busy band.
+ */
+
+#ifndef _LEARN_H_
+#define _LEARN_H_
+
+#include <stdint.h>
+#include "msg.h"
+#include "fw_decode.h"
+
+/* candidate frames tracked at once, the least seen ones are recycled */
+#define LEARN_SLOTS			16
+#define LEARN_MAX_K			3
+/* frames are compared as a string of symbol units, up to that many */
+#define LEARN_KEY_BITS		512
+/* a candidate not seen for that long is forgotten */
+#define LEARN_STALE_MS		(10 * 60 * 1000)
+
+enum {
+	learn_Unknown = 0,
+	learn_PWM,			// one short, one long phase; firmware 'A', 'E' or 'T'
+	learn_Manchester,	// 1 or 2 half bits phases, firmware 'M'
+	learn_OOK,			// phases are multiples of the bit period, firmware 'O'
+};
+
+typedef struct learn_result_t {
+	uint8_t			encoding;
+	uint8_t			k;						// number of clusters
+	uint8_t			center[LEARN_MAX_K];	// phase clusters, in ticks
+	uint32_t		weight[LEARN_MAX_K];	// phases in each
+	uint16_t		period;					// bit period, in ticks
+	uint16_t		period_us;
+	uint16_t		bits;					// frame length
+	unsigned		repeats;
+	/* what the firmware would send in DEMOD mode, empty if nothing */
+	char			line[FW_LINE_SIZE];
+} learn_result_t, *learn_result_p;
+
+typedef struct learn_slot_t {
+	uint64_t		last;		// gettime_ms() when last seen
+	unsigned		hits;
+	uint8_t			reported;
+	uint8_t			encoding, k;
+	uint16_t		units, bits;
+	uint8_t			key[LEARN_KEY_BITS / 8];
+	uint32_t		hist[256];	// phase durations, over all repeats
+} learn_slot_t, *learn_slot_p;
+
+typedef struct learn_t {
+	unsigned		repeats;	// wanted before a frame is reported
+	unsigned		frames, unknown;
+	learn_slot_t	slot[LEARN_SLOTS];
+} learn_t, *learn_p;
+
+void
+learn_init(
+		learn_p l,
+		unsigned repeats);
+
+/*
+ * Feed a raw pulse message; returns 1 and fills 'res' when that frame was
+ * seen enough times, 0 otherwise.
+ */
+int
+learn_frame(
+		learn_p l,
+		msg_p m,
+		uint64_t now,
+		learn_result_p res);
+
+/*
+ * 1D k-means over a histogram of durations, 'k' sorted centers in 'center'
+ * and their weight; returns the cost (sum of the squared distances)
+ */
+uint64_t
+learn_kmeans(
+		const uint32_t * hist,
+		int k,
+		uint8_t * center,
+		uint32_t * weight);
+
+const char *
+learn_encoding_name(
+		uint8_t encoding);
+
+/*
+ * Format the message of 'r' for the mapping file, returns it's length, 0
+ * if the firmware can't decode it (or the mapping file can't match it)
+ */
+int
+learn_mapping(
+		learn_result_p r,
+		char * dst,
+		size_t size);
+
+#endif /* _LEARN_H_ */
@@ -0,0 +1,223 @@
+/*
+ * log.c
+ *
+ *  Created on: 17 Oct 2026
+ *
+ * Asynchronous log ring. The serial reader and the MQTT thread used to
+ * printf() directly, so a slow stdout (journald pipe etc) would block the
+ * serial reader and we'd lose frames.
+ * Here the producers claim a slot in a fixed ring (lock free, multiple
+ * producers) format their line in it, and a background thread writes them
+ * out. If the ring is full, the line is dropped and counted instead.
+ */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <errno.h>
+#include "log.h"
+
+#define LOG_RING_SIZE	256		// power of two
+#define LOG_LINE_SIZE	1152	// an 'MP' line fits
+
+typedef struct log_slot_t {
+	uint32_t	seq;
+	uint16_t	len;
+	char		line[LOG_LINE_SIZE];
+} log_slot_t;
+
+int			log_level = log_Raw;
+unsigned	log_raw_sample = 1;
+
+static struct {
+	log_slot_t		slot[LOG_RING_SIZE];
+	uint32_t		head;	// next slot for producers
+	uint32_t		tail;	// next slot for the flusher
+	uint32_t		dropped, raw_count;
+	int				running;
+	FILE *			out;
+	sem_t			sem;
+	pthread_t		thread;
+} ring;
+
+static void __attribute__((constructor))
+log_init()
+{
+	for (uint32_t i = 0; i < LOG_RING_SIZE; i++)
+		ring.slot[i].seq = i;
+	sem_init(&ring.sem, 0, 0);
+}
+
+/*
+ * Claim a slot, return NULL if the ring is full. The slot needs to be
+ * released with log_commit()
+ */
+static log_slot_t *
+log_claim(
+		uint32_t * pos)
+{
+	uint32_t p = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+	do {
+		log_slot_t * s = &ring.slot[p & (LOG_RING_SIZE - 1)];
+		int32_t dif = (int32_t)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - p);
+
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&ring.head, &p, p + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				*pos = p;
+				return s;
+			}
+		} else if (dif < 0) {
+			__atomic_add_fetch(&ring.dropped, 1, __ATOMIC_RELAXED);
+			return NULL;
+		} else
+			p = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+	} while (1);
+}
+
+static void
+log_commit(
+		log_slot_t * s,
+		uint32_t pos,
+		int len)
+{
+	s->len = len < LOG_LINE_SIZE ? len : LOG_LINE_SIZE - 1;
+	/* make sure it's a whole line, even when truncated */
+	if (s->len && s->line[s->len - 1] != '\n') {
+		if (s->len == LOG_LINE_SIZE - 1)
+			s->len--;
+		s->line[s->len++] = '\n';
+	}
+	__atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&ring.sem);
+}
+
+static int
+log_want(
+		int level)
+{
+	if (level > log_level)
+		return 0;
+	if (level == log_Raw && log_raw_sample > 1 &&
+			(__atomic_fetch_add(&ring.raw_count, 1, __ATOMIC_RELAXED) %
+					log_raw_sample))
+		return 0;
+	return 1;
+}
+
+void
+log_printf(
+		int level,
+		const char * fmt,
+		...)
+{
+	if (!log_want(level))
+		return;
+	uint32_t pos;
+	log_slot_t * s = log_claim(&pos);
+	if (!s)
+		return;
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(s->line, LOG_LINE_SIZE, fmt, ap);
+	va_end(ap);
+	log_commit(s, pos, len < 0 ? 0 : len);
+}
+
+void
+log_msg(
+		int level,
+		msg_p m,
+		const char * pfx)
+{
+	if (!log_want(level))
+		return;
+	uint32_t pos;
+	log_slot_t * s = log_claim(&pos);
+	if (!s)
+		return;
+	log_commit(s, pos, msg_sprint(s->line, LOG_LINE_SIZE, m, pfx));
+}
+
+uint32_t
+log_dropped()
+{
+	return __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED);
+}
+
+/* write out everything that is ready, return number of lines written */
+static int
+log_drain()
+{
+	int res = 0;
+	do {
+		log_slot_t * s = &ring.slot[ring.tail & (LOG_RING_SIZE - 1)];
+		if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != ring.tail + 1)
+			break;
+		fwrite(s->line, s->len, 1, ring.out);
+		__atomic_store_n(&s->seq, ring.tail + LOG_RING_SIZE,
+				__ATOMIC_RELEASE);
+		ring.tail++;
+		res++;
+	} while (1);
+	return res;
+}
+
+static void *
+log_thread(
+		void * param)
+{
+	uint32_t reported = 0;
+
+	while (__atomic_load_n(&ring.running, __ATOMIC_ACQUIRE)) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		if (sem_timedwait(&ring.sem, &ts) && errno != ETIMEDOUT &&
+				errno != EINTR)
+			break;
+		/* one post per line, drain them all anyway */
+		while (sem_trywait(&ring.sem) == 0)
+			;
+		int count = log_drain();
+		uint32_t dropped = log_dropped();
+		if (dropped != reported) {
+			fprintf(ring.out, "# log: %u lines dropped\n",
+					dropped - reported);
+			reported = dropped;
+			count++;
+		}
+		if (count)
+			fflush(ring.out);
+	}
+	log_drain();
+	fflush(ring.out);
+	return NULL;
+}
+
+int
+log_start(
+		FILE * out)
+{
+	ring.out = out;
+	ring.running = 1;
+	if (pthread_create(&ring.thread, NULL, log_thread, NULL)) {
+		ring.running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+void
+log_stop()
+{
+	if (!ring.running)
+		return;
+	__atomic_store_n(&ring.running, 0, __ATOMIC_RELEASE);
+	sem_post(&ring.sem);
+	pthread_join(ring.thread, NULL);
+}
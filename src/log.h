@@ -0,0 +1,59 @@
+/*
+ * log.h
+ *
+ *  Created on: 17 Oct 2026
+ */
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "msg.h"
+
+/*
+ * Log levels. A line is logged if it's level is <= log_level
+ */
+enum {
+	log_Error = 0,
+	log_Warn,
+	log_Info,		// published/received MQTT messages, SEND lines
+	log_Raw,		// raw lines from the serial port(s)
+	log_Debug,
+};
+
+extern int			log_level;
+/* only log one raw line every 'log_raw_sample' lines; 0 or 1 logs all */
+extern unsigned		log_raw_sample;
+
+/*
+ * Start the background flusher thread, writing to 'out'. Until that is
+ * called, lines accumulate in the ring (and get dropped when it's full)
+ */
+int
+log_start(
+		FILE * out);
+/* Flush whatever is left, stop the flusher */
+void
+log_stop();
+
+/*
+ * These never block; if the ring is full, the line is dropped and counted
+ */
+void
+log_printf(
+		int level,
+		const char * fmt,
+		...) __attribute__((format(printf, 2, 3)));
+
+void
+log_msg(
+		int level,
+		msg_p m,
+		const char * pfx);
+
+/* number of lines dropped so far */
+uint32_t
+log_dropped();
+
+#endif /* _LOG_H_ */
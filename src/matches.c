@@ -11,14 +11,81 @@
 #include "matches.h"
 
 msg_match_t * matches = NULL;
+msg_scene_t * scenes = NULL;
+pthread_mutex_t match_lock = PTHREAD_MUTEX_INITIALIZER;
 /* TODO: Put that in the environment */
 extern const char *mqtt_root;
 
+/* frames in a scene, more than that is most likely a typo */
+#define SCENE_MAX_FRAMES	64
+
+int
+parse_scene(
+		fileio_p file,
+		char * l )
+{
+	const char * mqtt_path;
+	const char * msg[SCENE_MAX_FRAMES];
+	int count = 0;
+
+	do {
+		mqtt_path = strsep(&l, " \t");
+	} while (mqtt_path && !*mqtt_path);
+
+	if (!mqtt_path || !*mqtt_path) {
+		fprintf(stderr, "%s:%d missing MQTT path\n",
+				file->fname, file->linecount);
+		return -1;
+	}
+	while (l) {
+		const char * m = strsep(&l, " \t");
+		if (!*m)
+			continue;
+		if (count == SCENE_MAX_FRAMES) {
+			fprintf(stderr, "%s:%d scene has more than %d frames\n",
+					file->fname, file->linecount, SCENE_MAX_FRAMES);
+			return -1;
+		}
+		msg[count++] = m;
+	}
+	if (!count) {
+		fprintf(stderr, "%s:%d empty scene\n",
+				file->fname, file->linecount);
+		return -1;
+	}
+	msg_scene_t *s = calloc(1, sizeof(msg_scene_t) +
+			(count * sizeof(s->frame[0])) +
+			strlen(mqtt_root) + 1 + strlen(mqtt_path) + 1);
+	char *d = (char*)&s->frame[count];
+	sprintf(d, "%s/%s", mqtt_root, mqtt_path);
+	s->mqtt_path = d;
+
+	for (int i = 0; i < count; i++) {
+		s->frame[i] = calloc(1, sizeof(msg_t) + MSG_MAX_BYTES);
+		if (msg_parse(s->frame[i], MSG_MAX_BYTES, msg[i]) != 0) {
+			fprintf(stderr, "%s:%d Can't parse '%s'\n",
+					file->fname, file->linecount, msg[i]);
+			while (i >= 0)
+				free(s->frame[i--]);
+			free(s);
+			return -1;
+		}
+	}
+	s->count = count;
+	s->lineno = file->linecount;
+	s->next = scenes;
+	scenes = s;
+
+	return 0;
+}
+
 int
 parse_matches(
 		fileio_p file,
 		char * l )
 {
+	if (!strncmp(l, "SCENE", 5) && (l[5] == ' ' || l[5] == '\t'))
+		return parse_scene(file, l + 6);
 	const char * msg = strsep(&l, " \t");
 	const char * mqtt_path = strsep(&l, " \t");
 	const char * mqtt_qos = strsep(&l, " \t");
@@ -26,7 +93,8 @@ parse_matches(
 
 	//printf("%d %s %s %s %s\n",  file->linecount, msg,
 	//		mqtt_path, mqtt_qos, mqtt_pload);
-	if (!msg || msg[0] != 'M' || (msg[1] != 'A' && msg[1] != 'M')) {
+	/* the types a firmware decoder outputs, bar OOK */
+	if (!msg || msg[0] != 'M' || !msg[1] || !strchr("AMETD", msg[1])) {
 		fprintf(stderr, "%s:%d invalid message format\n",
 				file->fname, file->linecount);
 		return -1;
@@ -44,7 +112,7 @@ parse_matches(
 			sizeof (msg_match_t);
 	msg_match_t *m = calloc(1, size);
 
-	if (msg_parse(&m->msg, 256, msg) != 0) {
+	if (msg_parse(&m->msg, MSG_MAX_BYTES, msg) != 0) {
 		fprintf(stderr, "%s:%d Can't parse '%s'\n",
 				file->fname, file->linecount, msg);
 		free(m);
@@ -71,3 +139,102 @@ parse_matches(
 
 	return 0;
 }
+
+/* same payload, except for the bits of 'd' the decoder wasn't sure of */
+static int
+match_erased(
+		msg_p m,
+		msg_p d )
+{
+	for (int i = 0; i < d->bytecount; i++) {
+		uint8_t x = m->msg[i] ^ d->msg[i];
+		for (int e = 0; e < d->erased && x; e++)
+			if (d->erase[e] / 8 == i)
+				x &= ~(0x80 >> (d->erase[e] % 8));
+		if (x)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * A truncated frame is a prefix of the mapping, so the length has to agree
+ * too; give or take the sync bit some decoders keep. A mapping without a
+ * bit count matches any length.
+ */
+static int
+match_length(
+		msg_p m,
+		msg_p d )
+{
+	return !m->bitcount ||
+			(d->bitcount + 1 >= m->bitcount && d->bitcount <= m->bitcount + 1);
+}
+
+msg_match_t *
+match_find(
+		msg_match_t * from,
+		msg_p d )
+{
+	uint16_t want = ((uint16_t*)d->msg)[0];
+
+	if (d->erased && d->erased <= MSG_ERASE_MAX) {
+		while (from && !(match_length(&from->msg, d) &&
+				match_erased(&from->msg, d)))
+			from = from->next;
+		/*
+		 * if the erased bits could make it another code altogether, we
+		 * can't tell which one it was
+		 */
+		for (msg_match_t * m = matches; m && from; m = m->next)
+			if (match_length(&m->msg, d) && match_erased(&m->msg, d) &&
+					memcmp(m->msg.msg, from->msg.msg, d->bytecount))
+				return NULL;
+		return from;
+	}
+	while (from) {
+		if (*((uint16_t*)from->msg.msg) == want &&
+				match_length(&from->msg, d) &&
+				!memcmp(from->msg.msg, d->msg, d->bytecount))
+			return from;
+		from = from->next;
+	}
+	return NULL;
+}
+
+int
+match_route(
+		msg_p d,
+		int * order,
+		uint64_t now )
+{
+	int score[BRIDGE_MAX];
+
+	for (int b = 0; b < bridge_count; b++)
+		score[b] = INT16_MIN;
+
+	pthread_mutex_lock(&match_lock);
+	msg_match_t *m = match_find(matches, d);
+	const char * path = m ? m->mqtt_path : NULL;
+	for (m = matches; m && path; m = m->next) {
+		if (strcmp(m->mqtt_path, path))
+			continue;
+		for (int b = 0; b < bridge_count; b++) {
+			int s = link_score(&m->link[b], now);
+			if (s > score[b])
+				score[b] = s;
+		}
+	}
+	pthread_mutex_unlock(&match_lock);
+
+	/* insertion sort, stable so unknown links keep the command line order */
+	for (int b = 0; b < bridge_count; b++) {
+		int i = b;
+		while (i > 0 && score[order[i - 1]] < score[b]) {
+			order[i] = order[i - 1];
+			i--;
+		}
+		order[i] = b;
+	}
+	return bridge_count;
+}
@@ -10,27 +10,75 @@
 
 #include "msg.h"
 #include "utils.h"
+#include "ratelimit.h"
+#include "bridge.h"
 
 typedef struct msg_match_t {
 	struct msg_match_t *next;
 	union {
 		msg_t			msg;
-		uint8_t 		b[sizeof(msg_t) + (256/8)];
+		uint8_t 		b[sizeof(msg_t) + MSG_MAX_BYTES];
 	};
 	int 				mqtt_qos : 4,
 					pload_flags : 3, lineno;
 	uint64_t			last;	// last time this was sent
+	bucket_t			rx, tx;	// publish and transmit rate limits
+	link_t				link[BRIDGE_MAX];	// how well each bridge hears it
 	const char * 	msg_txt;
 	const char *		mqtt_path;
 	const char *		mqtt_pload;
 	char 			_data[];
 } msg_match_t;
 
+/*
+ * A scene is an ordered list of frames, sent as one burst when it's MQTT
+ * topic is received. In the mapping file:
+ * SCENE <mqtt path> <message> [<message>...]
+ */
+typedef struct msg_scene_t {
+	struct msg_scene_t *next;
+	const char *		mqtt_path;
+	int					lineno, count;
+	msg_p				frame[];
+} msg_scene_t;
+
+int
+parse_scene(
+		fileio_p file,
+		char * l );
+
+/* parses a mapping file line, including scenes */
 int
 parse_matches(
 		fileio_p file,
 		char * l );
 
+/*
+ * Return the first match starting at 'from' that has the same message
+ * payload and bit count (within one) as 'd', or NULL. The bits of 'd' the
+ * decoder wasn't sure about can be either value, as long as that doesn't
+ * match another code.
+ */
+msg_match_t *
+match_find(
+		msg_match_t * from,
+		msg_p d );
+
+/*
+ * Fill 'order' with the bridges to use to transmit 'd', best first; that's
+ * the ones that heard the device (any message with the same MQTT path)
+ * best. Bridges that never heard it come last, in their normal order.
+ * Returns the number of bridges.
+ */
+int
+match_route(
+		msg_p d,
+		int * order,
+		uint64_t now );
+
 extern msg_match_t * matches;
+/* held by the readers while they update 'last' and 'link' */
+extern pthread_mutex_t match_lock;
+extern msg_scene_t * scenes;
 
 #endif /* _MATCHES_H_ */
@@ -7,6 +7,7 @@
 
 #include <arpa/inet.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "msg.h"
 
@@ -26,6 +27,31 @@ msg_stuffbit(
 	m->bytecount = 1 + (m->bitcount / 8);
 }
 
+void
+msg_erase(
+		msg_p m)
+{
+	/* the indexes are 8 bits, like the firmware's; hopeless past that */
+	if (m->bitcount > 0xff) {
+		m->erased = MSG_ERASE_MAX + 1;
+		return;
+	}
+	if (m->erased < MSG_ERASE_MAX)
+		m->erase[m->erased] = m->bitcount;
+	if (m->erased <= MSG_ERASE_MAX)
+		m->erased++;
+}
+
+void
+msg_flip_erased(
+		msg_p m,
+		unsigned mask)
+{
+	for (int i = 0; i < m->erased && i < MSG_ERASE_MAX; i++)
+		if (mask & (1 << i))
+			m->msg[m->erase[i] / 8] ^= 0x80 >> (m->erase[i] % 8);
+}
+
 /* Shift the whole buffer right or left, depending */
 void
 msg_shift(
@@ -43,6 +69,19 @@ msg_shift(
 	}
 	/* adjust bit counts if we add/removed any */
 	m->bitcount = m->bitcount - shift;
+	/*
+	 * and the erasures move along with the data, that's 8 + shift bits;
+	 * the ones shifted out are gone
+	 */
+	if (m->erased <= MSG_ERASE_MAX) {
+		int n = 0;
+		for (int i = 0; i < m->erased; i++) {
+			int e = m->erase[i] - 8 - shift;
+			if (e >= 0 && e < m->bitcount)
+				m->erase[n++] = e;
+		}
+		m->erased = n;
+	}
 }
 
 msg_p
@@ -57,30 +96,183 @@ msg_init(
 	m->pulses = type == 'P';
 	m->bitcount = m->bytecount = 0;
 	m->pulse_duration = m->checksum_valid = 0;
+	m->erased = 0;
+	m->repeats = m->gap = 0;
 	m->msg[0] = 0;
 	return m;
 }
 
+/* pack the phases of 'pulses' pulses of 'm', like the firmware does */
+static unsigned
+msg_pack(
+		msg_p m,
+		unsigned pulses,
+		uint8_t * dst)
+{
+	uint8_t table[MSG_PACK_TABLE], used = 0;
+	uint32_t acc = 0;
+	unsigned bits = 0, len = 0;
+
+	for (unsigned i = 0; i < pulses * 2; i++) {
+		uint8_t d = m->msg[i];
+		int s = -1;
+		for (int t = 0; t < used && s < 0 && d != MSG_PACK_SILENCE; t++)
+			if (abs(d - table[t]) <= table[t] / 8)
+				s = t;
+		if (s >= 0) {
+			acc = (acc << 2) | s;
+			bits += 2;
+		} else {
+			acc = (acc << 10) | (MSG_PACK_ESCAPE << 8) | d;
+			bits += 10;
+			if (d != MSG_PACK_SILENCE && used < MSG_PACK_TABLE)
+				table[used++] = d;
+		}
+		while (bits >= 8) {
+			bits -= 8;
+			dst[len++] = acc >> bits;
+		}
+	}
+	/* the firmware wants the padding to be ones, it's a truncated escape */
+	if (bits)
+		dst[len++] = (acc << (8 - bits)) | (0xff >> bits);
+	return len;
+}
+
+static int
+msg_format(
+		char * dst,
+		size_t size,
+		msg_p m,
+		const char * pfx,
+		int tx)
+{
+	uint8_t chk = 0x55;
+	uint8_t type = m->type;
+	const uint8_t * data = m->msg;
+	unsigned count = m->bitcount, bytes = (m->bitcount + 7) / 8;
+	uint8_t packed[tx && m->pulses ? ((m->bytecount * 10) / 8) + 1 : 1];
+
+	if (m->pulses) {
+		if (count > m->bytecount / 2)
+			count = m->bytecount / 2;
+		bytes = count * 2;
+	}
+	/* packing rounds the phases, only the firmware gets them like that */
+	if (tx && m->pulses) {
+		bytes = msg_pack(m, count, packed);
+		data = packed;
+		type = 'Q';
+	}
+	int l = snprintf(dst, size, "%s%sM%c",
+					pfx ? pfx : "", pfx && *pfx ? " " : "", type);
+	if (m->pulse_duration && l < size)
+		l += snprintf(dst + l, size - l, "!%02x", m->pulse_duration);
+	if (l < size)
+		l += snprintf(dst + l, size - l, ":");
+	for (unsigned i = 0; i < bytes; i++) {
+		if (l < size)
+			l += snprintf(dst + l, size - l, "%02x", data[i]);
+		chk += data[i];
+	}
+	/*
+	 * where the firmware puts them, they're not in the checksum; it
+	 * doesn't want them back though. Just the ?ff when hopeless.
+	 */
+	if (!tx && m->erased > MSG_ERASE_MAX) {
+		if (l < size)
+			l += snprintf(dst + l, size - l, "?ff");
+	} else for (unsigned i = 0; !tx && i < m->erased && l < size; i++)
+		l += snprintf(dst + l, size - l, "?%02x", m->erase[i]);
+	chk += count;
+	chk += m->pulse_duration;
+	/* long frames have a 16 bits count */
+	if (count > 0xff) {
+		chk += count >> 8;
+		if (l < size)
+			l += snprintf(dst + l, size - l, "&%04x", count & 0xffff);
+	} else if (l < size)
+		l += snprintf(dst + l, size - l, "#%02x", count);
+	if (m->repeats && l < size)
+		l += snprintf(dst + l, size - l, "+%02x", m->repeats);
+	if (m->gap && l < size)
+		l += snprintf(dst + l, size - l, "/%02x", m->gap);
+	chk += m->repeats + m->gap;
+	if (l < size)
+		l += snprintf(dst + l, size - l, "*%02x\n", chk);
+	return l;
+}
+
+int
+msg_sprint(
+		char * dst,
+		size_t size,
+		msg_p m,
+		const char * pfx)
+{
+	return msg_format(dst, size, m, pfx, 0);
+}
+
+int
+msg_sprint_tx(
+		char * dst,
+		size_t size,
+		msg_p m)
+{
+	return msg_format(dst, size, m, "", 1);
+}
+
 void
 msg_display(
 		FILE *out,
 		msg_p m,
 		const char * pfx)
 {
-	uint8_t chk = 0x55;
-	fprintf(out, "%s%sM%c", pfx ? pfx : "", pfx && *pfx ? " " : "", m->type);
-	if (m->pulse_duration)
-		fprintf(out, "!%02x", m->pulse_duration);
-	fprintf(out, ":");
-	for (uint8_t i = 0; i < (m->bitcount + 7) / 8; i++) {
-		fprintf(out, "%02x", m->msg[i]);
-		chk += m->msg[i];
+	/* the biggest there is, raw pulses take 2 bytes per pulse */
+	char line[(pfx ? strlen(pfx) : 0) + 32 + (3 * (MSG_ERASE_MAX + 1)) +
+			MSG_MAX_BYTES * 2];
+
+	msg_sprint(line, sizeof(line), m, pfx);
+	fputs(line, out);
+}
+
+const char *
+msg_type_name(
+		uint8_t type)
+{
+	switch (type) {
+		case 'A': return "ask";
+		case 'M': return "manchester";
+		case 'O': return "ook";
+		case 'P': return "pulses";
+		case 'Q': return "packed";
+		case 'E': return "fixed";
+		case 'T': return "tristate";
+		case 'D': return "distance";
+		case 'N': return "none";
 	}
-	chk += m->bitcount;
-	chk += m->pulse_duration;
-	fprintf(out, "#%02x*%02x\n", m->bitcount, chk);
+	return NULL;
 }
 
+int
+msg_tristate(
+		msg_p m,
+		char * dst,
+		size_t size)
+{
+	int l = 0;
+
+	if (m->type != 'T' || (m->bitcount & 1) || m->bitcount / 2 >= size)
+		return -1;
+	for (int i = 0; i < m->bitcount; i += 2) {
+		uint8_t p = (m->msg[i / 8] >> (6 - (i % 8))) & 3;
+		if (p == 2)	// 10 isn't a valid symbol
+			return -1;
+		dst[l++] = "0F-1"[p];
+	}
+	dst[l] = 0;
+	return l;
+}
 
 /*
  * Return 0 if a double character hex value was decoded, otherwise,
@@ -118,7 +310,7 @@ msg_parse(
 {
 	if (*line == '#')
 		return -1;
-	if (*line != 'M')
+	if (*line != 'M' || !msg_type_name(line[1]))
 		return -1;
 	msg_init(m, line[1]);
 
@@ -142,16 +334,94 @@ msg_parse(
 				m->bitcount = d;
 				m->chk += d;
 				break;
+			case '&': /* same, 16 bits, for frames longer than 255 */
+				m->bitcount = ((m->bitcount << 8) | d) & 0xffff;
+				m->chk += d;
+				break;
 			case '!': /* pulse duration */
 				m->pulse_duration = d;
 				m->chk += d;
 				/* don't really need this at this end */
 				break;
+			case '+': /* times to send it */
+				m->repeats = d;
+				m->chk += d;
+				break;
+			case '/': /* ms of silence after each */
+				m->gap = d;
+				m->chk += d;
+				break;
+			case '?': /* bit the decoder wasn't sure about, 0xff for too many */
+				if (d == 0xff)
+					m->erased = MSG_ERASE_MAX + 1;
+				else if (m->erased < MSG_ERASE_MAX)
+					m->erase[m->erased++] = d;
+				else
+					m->erased = MSG_ERASE_MAX + 1;
+				break;
 			case '*': /* checksum */
 				has_checksum = 1;
 				m->checksum_valid = d == m->chk;
 				break;
 		}
 	}
-	return !has_checksum || m->checksum_valid ? 0 : 1;
+	if (has_checksum && !m->checksum_valid)
+		return 1;
+	if (m->type == 'Q') {
+		if (msg_unpack(m, maxsize))
+			return -1;
+		m->type = 'P';
+		m->pulses = 1;
+	}
+	return 0;
+}
+
+static inline uint8_t
+msg_unpack_bits(
+		const uint8_t * src,
+		unsigned bit,
+		int n)
+{
+	uint16_t w = (src[bit / 8] << 8) | src[(bit / 8) + 1];
+	return (w >> (16 - n - (bit % 8))) & ((1 << n) - 1);
+}
+
+int
+msg_unpack(
+		msg_p m,
+		uint16_t maxsize)
+{
+	unsigned len = m->bytecount, bit = 0;
+	/* one more, so the bits can always be read 16 at a time */
+	uint8_t src[len + 1];
+	uint8_t table[MSG_PACK_TABLE], used = 0;
+	/*
+	 * msg_parse() drops what doesn't fit; mostly escapes is larger than
+	 * 'P', keep what we got then, like a 'P' that is too long
+	 */
+	int ret = len < maxsize ? -1 : 0;
+
+	memcpy(src, m->msg, len);
+	src[len] = 0;
+	m->bytecount = 0;
+	for (unsigned i = 0; i < m->bitcount * 2; i++) {
+		if (bit + 2 > len * 8)
+			return ret;
+		uint8_t d = msg_unpack_bits(src, bit, 2);
+		bit += 2;
+		if (d == MSG_PACK_ESCAPE) {
+			if (bit + 8 > len * 8)
+				return ret;
+			d = msg_unpack_bits(src, bit, 8);
+			bit += 8;
+			if (d != MSG_PACK_SILENCE && used < MSG_PACK_TABLE)
+				table[used++] = d;
+		} else if (d < used)
+			d = table[d];
+		else
+			return -1;
+		if (m->bytecount < maxsize)
+			m->msg[m->bytecount++] = d;
+	}
+	return 0;
 }
@@ -11,16 +11,44 @@
 #include <stdio.h>
 #include <stdint.h>
 
+/*
+ * Message types, the letter after the 'M':
+ *	A	ASK; the longest phase of each pulse is the bit
+ *	M	manchester
+ *	O	OOK, NRZ
+ *	P	raw pulses, two phase durations per pulse
+ *	Q	packed raw pulses, msg_parse() turns them into a 'P', and
+ *		msg_sprint_tx() prints a 'P' as one
+ *	E	fixed code PWM (EV1527 and the likes), without the sync
+ *	T	PT2262 tri-state; bit pairs 00, 11, 01 are '0', '1', 'F'
+ *	D	pulse distance
+ *	N	(host only) pulses that could not be decoded
+ */
+
+/*
+ * Bits the decoders were not sure about ('?' in the message lines); more
+ * than that is hopeless, and 'erased' is then past MSG_ERASE_MAX
+ */
+#define MSG_ERASE_MAX	6
+
 typedef struct msg_t {
 	uint32_t		pulses: 1, decoded: 1, type: 7, chk: 8, bitcount;
 	uint32_t		pulse_duration: 8, checksum_valid: 1,
 				max_size : 11, bytecount;
+	uint8_t		erased;		// number of entries in erase[]
+	uint8_t		erase[MSG_ERASE_MAX];	// bit indexes
+	/* transmit only; times to send it (0 for the firmware default), and
+	 * ms of silence after each */
+	uint8_t		repeats, gap;
 	uint8_t		msg[0];
 } msg_t, *msg_p;
 
+/* payload bytes a msg_full_t (or a mapping) holds */
+#define MSG_MAX_BYTES	512
+
 typedef union {
 	msg_t m;
-	uint8_t filler[sizeof(msg_t) + 512];
+	uint8_t filler[sizeof(msg_t) + MSG_MAX_BYTES];
 } msg_full_t;
 
 msg_p
@@ -33,21 +61,90 @@ msg_stuffbit(
 		msg_p m,
 		uint8_t b);
 
+/* mark the next bit as erased */
+void
+msg_erase(
+		msg_p m);
+
+/* flip the erased bits selected by 'mask', bit 0 for erase[0] etc */
+void
+msg_flip_erased(
+		msg_p m,
+		unsigned mask);
+
 void
 msg_shift(
 		msg_p m,
 		int8_t shift);
 
+/*
+ * Format 'm' as a message line in 'dst', return the length it needed,
+ * like snprintf()
+ */
+int
+msg_sprint(
+		char * dst,
+		size_t size,
+		msg_p m,
+		const char * pfx);
+
+/*
+ * Same, for the firmware; a 'P' goes packed, as a 'Q', which rounds the
+ * phases to the table entries, and there are no '?' erased bits
+ */
+int
+msg_sprint_tx(
+		char * dst,
+		size_t size,
+		msg_p m);
+
 void
 msg_display(
 		FILE *out,
 		msg_p m,
 		const char * pfx);
 
+/* name of message 'type', NULL if we don't know about it */
+const char *
+msg_type_name(
+		uint8_t type);
+
+/*
+ * Format a 'T' message as the PT2262 tri-state code ("0F10..."), return
+ * it's length, or -1 if it isn't a valid one
+ */
+int
+msg_tristate(
+		msg_p m,
+		char * dst,
+		size_t size);
+
 int
 msg_parse(
 		msg_p m,
 		uint16_t maxsize,
 		const char *line );
 
+/*
+ * Packed pulses ('Q'); every phase, high then low, is 2 bits: an index in
+ * a table of up to MSG_PACK_TABLE durations, or MSG_PACK_ESCAPE followed
+ * by the 8 bits duration. An escaped duration goes in the table while
+ * there is room, unless it's the final silence. The table starts empty
+ * with each message, bits go MSB first and the last byte is padded with
+ * ones.
+ */
+#define MSG_PACK_TABLE		3
+#define MSG_PACK_ESCAPE		3
+#define MSG_PACK_SILENCE	255
+
+/*
+ * Expand the payload of a 'Q' message into the 'P' layout, in place;
+ * returns 0, or -1 if it doesn't have all the phases 'bitcount' says.
+ * msg_parse() does it, and makes it a 'P'.
+ */
+int
+msg_unpack(
+		msg_p m,
+		uint16_t maxsize);
+
 #endif /* _MSG_H_ */
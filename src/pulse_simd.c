@@ -0,0 +1,262 @@
+/*
+ * pulse_simd.c
+ *
+ *  Created on: 17 Oct 2026
+ *
+ * The kernels all compute, for 16 or 32 pulses at once:
+ *	d[k] = (pulse[k][0] + pulse[k][1]) & 0xff	(like the scalar search)
+ *	maybe[k] = d[k] >= 12 && |d[k] - d[k-1]| <= 12
+ * The AVX2 one is picked at runtime, so the build flags don't change.
+ */
+
+#include "pulse_simd.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define PULSE_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define PULSE_NEON
+#include <arm_neon.h>
+#endif
+
+#if PULSE_SYNC_LEN != 8
+#error pulse_sync_scan() run detection assumes 8 pulses
+#endif
+
+uint64_t
+pulse_sync_flags_c(
+		const pulse_t * pulse,
+		size_t k,
+		size_t count)
+{
+	uint64_t m = 0;
+	if (k >= count)
+		return 0;
+	size_t n = count - k > 64 ? 64 : count - k;
+	uint8_t prev = pulse[k - 1][0] + pulse[k - 1][1];
+
+	for (size_t i = 0; i < n; i++) {
+		uint8_t d = pulse[k + i][0] + pulse[k + i][1];
+		uint8_t delta = d > prev ? d - prev : prev - d;
+		if (d >= PULSE_SYNC_MIN && delta <= PULSE_SYNC_DELTA)
+			m |= 1ULL << i;
+		prev = d;
+	}
+	return m;
+}
+
+#ifdef PULSE_X86
+/* durations of 16 pulses */
+static inline __m128i
+sse2_sums(
+		const pulse_t * p)
+{
+	const __m128i lo = _mm_set1_epi16(0x00ff);
+	__m128i a = _mm_loadu_si128((const __m128i *)p);
+	__m128i b = _mm_loadu_si128((const __m128i *)(p + 8));
+	a = _mm_and_si128(_mm_add_epi8(a, _mm_srli_epi16(a, 8)), lo);
+	b = _mm_and_si128(_mm_add_epi8(b, _mm_srli_epi16(b, 8)), lo);
+	return _mm_packus_epi16(a, b);
+}
+
+static uint64_t
+pulse_sync_flags_sse2(
+		const pulse_t * pulse,
+		size_t k,
+		size_t count)
+{
+	uint64_t m = 0;
+	if (k >= count)
+		return 0;
+	size_t i = 0, n = count - k > 64 ? 64 : count - k;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i min = _mm_set1_epi8(PULSE_SYNC_MIN);
+	const __m128i delta = _mm_set1_epi8(PULSE_SYNC_DELTA);
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i d = sse2_sums(pulse + k + i);
+		__m128i p = sse2_sums(pulse + k + i - 1);
+		__m128i ad = _mm_or_si128(_mm_subs_epu8(d, p), _mm_subs_epu8(p, d));
+		/* saturated a - b is zero when a <= b */
+		__m128i ok = _mm_and_si128(
+				_mm_cmpeq_epi8(_mm_subs_epu8(min, d), zero),
+				_mm_cmpeq_epi8(_mm_subs_epu8(ad, delta), zero));
+		m |= (uint64_t)(uint16_t)_mm_movemask_epi8(ok) << i;
+	}
+	if (i < n)
+		m |= pulse_sync_flags_c(pulse, k + i, count) << i;
+	return m;
+}
+
+/* durations of 32 pulses */
+__attribute__((target("avx2")))
+static inline __m256i
+avx2_sums(
+		const pulse_t * p)
+{
+	const __m256i lo = _mm256_set1_epi16(0x00ff);
+	__m256i a = _mm256_loadu_si256((const __m256i *)p);
+	__m256i b = _mm256_loadu_si256((const __m256i *)(p + 16));
+	a = _mm256_and_si256(_mm256_add_epi8(a, _mm256_srli_epi16(a, 8)), lo);
+	b = _mm256_and_si256(_mm256_add_epi8(b, _mm256_srli_epi16(b, 8)), lo);
+	/* packus works per 128 bits lanes, put the quads back in order */
+	return _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+}
+
+__attribute__((target("avx2")))
+static uint64_t
+pulse_sync_flags_avx2(
+		const pulse_t * pulse,
+		size_t k,
+		size_t count)
+{
+	uint64_t m = 0;
+	if (k >= count)
+		return 0;
+	size_t i = 0, n = count - k > 64 ? 64 : count - k;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i min = _mm256_set1_epi8(PULSE_SYNC_MIN);
+	const __m256i delta = _mm256_set1_epi8(PULSE_SYNC_DELTA);
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i d = avx2_sums(pulse + k + i);
+		__m256i p = avx2_sums(pulse + k + i - 1);
+		__m256i ad = _mm256_or_si256(
+				_mm256_subs_epu8(d, p), _mm256_subs_epu8(p, d));
+		__m256i ok = _mm256_and_si256(
+				_mm256_cmpeq_epi8(_mm256_subs_epu8(min, d), zero),
+				_mm256_cmpeq_epi8(_mm256_subs_epu8(ad, delta), zero));
+		m |= (uint64_t)(uint32_t)_mm256_movemask_epi8(ok) << i;
+	}
+	if (i < n)
+		m |= pulse_sync_flags_sse2(pulse, k + i, count) << i;
+	return m;
+}
+#endif
+
+#ifdef PULSE_NEON
+static uint64_t
+pulse_sync_flags_neon(
+		const pulse_t * pulse,
+		size_t k,
+		size_t count)
+{
+	static const uint8_t bits[16] = {
+			1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint64_t m = 0;
+	if (k >= count)
+		return 0;
+	size_t i = 0, n = count - k > 64 ? 64 : count - k;
+	const uint8x16_t min = vdupq_n_u8(PULSE_SYNC_MIN);
+	const uint8x16_t delta = vdupq_n_u8(PULSE_SYNC_DELTA);
+	const uint8x16_t weight = vld1q_u8(bits);
+
+	for (; i + 16 <= n; i += 16) {
+		/* vld2 splits the phases for us */
+		uint8x16x2_t c = vld2q_u8(pulse[k + i]);
+		uint8x16x2_t l = vld2q_u8(pulse[k + i - 1]);
+		uint8x16_t d = vaddq_u8(c.val[0], c.val[1]);
+		uint8x16_t p = vaddq_u8(l.val[0], l.val[1]);
+		uint8x16_t ok = vandq_u8(vcgeq_u8(d, min),
+				vcleq_u8(vabdq_u8(d, p), delta));
+		uint8x16_t t = vandq_u8(ok, weight);
+		uint64_t mm = vaddv_u8(vget_low_u8(t)) |
+				(vaddv_u8(vget_high_u8(t)) << 8);
+		m |= mm << i;
+	}
+	if (i < n)
+		m |= pulse_sync_flags_c(pulse, k + i, count) << i;
+	return m;
+}
+#endif
+
+static uint64_t (*flags)(const pulse_t *, size_t, size_t);
+static const char * flags_name;
+static int flags_disabled;
+
+static void
+pulse_simd_init()
+{
+	flags = pulse_sync_flags_c;
+	flags_name = "c";
+	if (flags_disabled)
+		return;
+#ifdef PULSE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		flags = pulse_sync_flags_avx2;
+		flags_name = "avx2";
+	} else {
+		flags = pulse_sync_flags_sse2;
+		flags_name = "sse2";
+	}
+#elif defined(PULSE_NEON)
+	flags = pulse_sync_flags_neon;
+	flags_name = "neon";
+#endif
+}
+
+uint64_t
+pulse_sync_flags(
+		const pulse_t * pulse,
+		size_t k,
+		size_t count)
+{
+	if (!flags)
+		pulse_simd_init();
+	return flags(pulse, k, count);
+}
+
+const char *
+pulse_simd_name()
+{
+	if (!flags)
+		pulse_simd_init();
+	return flags_name;
+}
+
+void
+pulse_simd_disable(
+		int disable)
+{
+	flags_disabled = disable;
+	pulse_simd_init();
+}
+
+size_t
+pulse_sync_scan(
+		const pulse_t * pulse,
+		size_t start,
+		size_t count,
+		size_t * run_end)
+{
+	size_t k = start + 1;
+
+	/*
+	 * Blocks overlap by 7 pulses, so a run that crosses a block boundary
+	 * is found in the next block, and always starts in that block.
+	 */
+	while (k < count) {
+		uint64_t m = pulse_sync_flags(pulse, k, count);
+		uint64_t r = m & (m >> 1);	// 2 in a row
+		r &= r >> 2;				// 4
+		r &= r >> 4;				// 8
+		if (!r) {
+			k += 64 - (PULSE_SYNC_LEN - 1);
+			continue;
+		}
+		size_t s = k + __builtin_ctzll(r);
+		size_t e = s;
+		do {
+			uint64_t f = ~pulse_sync_flags(pulse, e, count);
+			if (f) {
+				e += __builtin_ctzll(f);
+				break;
+			}
+			e += 64;
+		} while (e < count);
+		*run_end = e < count ? e : count;
+		return s - 1;
+	}
+	return count;
+}
@@ -0,0 +1,69 @@
+/*
+ * pulse_simd.h
+ *
+ *  Created on: 17 Oct 2026
+ *
+ * Vectorised pre-filter for the host sync search in pulse_decoder().
+ *
+ * When the sync search looks at pulse k, it's running duration is always
+ * within 4 of the duration of pulse k-1, so pulse k forces a reset if
+ * it's duration is < 12, or more than 12 away from pulse k-1. A sync is 8
+ * pulses that don't force a reset, following one that does; so we flag
+ * the 'maybe' pulses 16 or 32 at a time, and the scalar search only runs
+ * on runs of 8 or more of them, starting at the reset before the run. It
+ * finds exactly the same sync the plain scalar search would.
+ */
+
+#ifndef _PULSE_SIMD_H_
+#define _PULSE_SIMD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t pulse_t[2];
+
+/* these match the thresholds in pulse_sync_scalar() */
+#define PULSE_SYNC_LEN		8
+#define PULSE_SYNC_MIN		12
+#define PULSE_SYNC_DELTA	12
+
+/*
+ * 'maybe' flags for pulses k to k+63 (k >= 1); bit i is pulse k+i, bits
+ * past 'count' are zero. Uses AVX2, SSE2 or NEON when available.
+ */
+uint64_t
+pulse_sync_flags(
+		const pulse_t * pulse,
+		size_t k,
+		size_t count);
+
+/* same, plain C; for reference, and the benchmark */
+uint64_t
+pulse_sync_flags_c(
+		const pulse_t * pulse,
+		size_t k,
+		size_t count);
+
+/*
+ * Find the first run of at least PULSE_SYNC_LEN 'maybe' pulses after
+ * 'start'; returns the index of the pulse before the run (it forces a
+ * reset, so the scalar search can start afresh there), and the end of the
+ * run in 'run_end'. Returns 'count' if there is none.
+ */
+size_t
+pulse_sync_scan(
+		const pulse_t * pulse,
+		size_t start,
+		size_t count,
+		size_t * run_end);
+
+/* name of the kernel in use, "avx2", "sse2", "neon" or "c" */
+const char *
+pulse_simd_name();
+
+/* force the plain C kernel, for the benchmark */
+void
+pulse_simd_disable(
+		int disable);
+
+#endif /* _PULSE_SIMD_H_ */
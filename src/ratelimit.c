@@ -0,0 +1,52 @@
+/*
+ * ratelimit.c
+ *
+ *  Created on: 17 Oct 2026
+ */
+
+#include "ratelimit.h"
+
+/*
+ * A button press is typically a handful of repeats, so a few per seconds
+ * is plenty for a device; the global ones are there to bound the CPU
+ * and broker load on a noisy band.
+ */
+rate_t rate_rx_device = { .rate = 2, .burst = 6 };
+rate_t rate_rx_global = { .rate = 50, .burst = 100 };
+rate_t rate_tx_device = { .rate = 2, .burst = 4 };
+rate_t rate_tx_global = { .rate = 5, .burst = 10 };
+
+int
+bucket_take(
+		bucket_p b,
+		const rate_t * r,
+		uint64_t now)
+{
+	if (!r->rate)	// disabled
+		return rate_Ok;
+	if (now < b->until) {
+		b->dropped++;
+		return rate_Limited;
+	}
+	uint32_t max = r->burst * 1000;
+	if (!b->last)
+		b->tokens = max;
+	else {
+		uint64_t t = b->tokens + ((now - b->last) * r->rate);
+		b->tokens = t > max ? max : t;
+	}
+	b->last = now;
+	/* it's been quiet for a while since the last backoff, forget it */
+	if (b->backoff && now - b->until > 4 * b->backoff)
+		b->backoff = 0;
+	if (b->tokens >= 1000) {
+		b->tokens -= 1000;
+		return rate_Ok;
+	}
+	b->backoff = b->backoff ? b->backoff * 2 : RATE_BACKOFF_MIN;
+	if (b->backoff > RATE_BACKOFF_MAX)
+		b->backoff = RATE_BACKOFF_MAX;
+	b->until = now + b->backoff;
+	b->dropped++;
+	return rate_Tripped;
+}
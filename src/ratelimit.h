@@ -0,0 +1,49 @@
+/*
+ * ratelimit.h
+ *
+ *  Created on: 17 Oct 2026
+ */
+
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <stdint.h>
+
+/*
+ * Token buckets, used to bound what a stuck button or a faulty sensor
+ * (or a runaway automation) can cost us. When a bucket runs dry it
+ * goes into backoff for a while, doubling every time it trips again.
+ */
+typedef struct rate_t {
+	uint16_t	rate;		// tokens per second
+	uint16_t	burst;		// bucket size
+} rate_t;
+
+typedef struct bucket_t {
+	uint64_t	last;		// last refill, 0 is 'full'
+	uint64_t	until;		// in backoff until then
+	uint32_t	tokens;		// in 1/1000th of a token
+	uint32_t	backoff;	// current backoff, in ms
+	uint32_t	dropped;	// total dropped
+} bucket_t, *bucket_p;
+
+enum {
+	rate_Ok = 0,
+	rate_Limited,		// dropped, bucket is in backoff
+	rate_Tripped,		// dropped, and bucket just went in backoff
+};
+
+#define RATE_BACKOFF_MIN	1000
+#define RATE_BACKOFF_MAX	(5 * 60 * 1000)
+
+/* defaults; per device on the RX publish and TX path, and global ones */
+extern rate_t rate_rx_device, rate_rx_global;
+extern rate_t rate_tx_device, rate_tx_global;
+
+int
+bucket_take(
+		bucket_p b,
+		const rate_t * r,
+		uint64_t now);
+
+#endif /* _RATELIMIT_H_ */
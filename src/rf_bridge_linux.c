@@ -43,8 +43,18 @@
 #include <ctype.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "matches.h"
+#include "decode.h"
+#include "log.h"
+#include "state.h"
+#include "ratelimit.h"
+#include "tx.h"
+#include "learn.h"
+#include "discover.h"
 
 #ifdef MQTT
 #include <mosquitto.h>
@@ -74,244 +84,112 @@ const char *mqtt_root = "mqtt";
 
 
 
-const char *serial_path = NULL;
-int serial_fd = -1;
-
-unsigned debug_sync;
-
-static uint64_t gettime_ms()
-{
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	return (((uint64_t)tv.tv_sec) * 1000) + (tv.tv_usec / 1000);
-}
-
-// overflow substraction for the counters
-uint8_t ovf_sub(uint8_t v1, uint8_t v2) {
-	return v1 > v2 ? 255 - v1 + v2 : v2 - v1;
-}
-// absolute value substraction for durations etc
-uint8_t abs_sub(uint8_t v1, uint8_t v2) {
-	return v1 > v2? v1 - v2 : v2 - v1;
-}
-
-
-/* Ambient Weather F007th */
-/* details are at https://forum.arduino.cc/index.php?topic=214436.15 */
-static uint8_t
-weather_chk(
-		const uint8_t *buff,
-		uint8_t length)
-{
-	uint8_t mask = 0x7C;
-	uint8_t checksum = 0x64;
-
-	for (uint8_t byteCnt = 0; byteCnt < length; byteCnt++) {
-		uint8_t data = buff[byteCnt];
-
-		for (int8_t bitCnt = 7; bitCnt >= 0; bitCnt--) {
-			// Rotate mask right
-			uint8_t bit = mask & 1;
-			mask = (mask >> 1) | (mask << 7);
-			if (bit)
-				mask ^= 0x18;
-			// XOR mask into checksum if data bit is 1
-			if (data & 0x80)
-				checksum ^= mask;
-			data <<= 1;
-		}
-	}
-	return checksum;
-}
+static bucket_t rx_global;
 
+/*
+ * Something is emitting (or asking us to emit) way too much; tell the
+ * world about it, once per backoff
+ */
 static void
-weather_decode(
-		msg_p m)
+rate_alert(
+		const char * dir,
+		const char * topic,
+		bucket_p b)
 {
-	uint8_t * msg = m->msg;
-	uint8_t chk = weather_chk(msg + 1, 5);
-	int temp = ((msg[3] & 0x7) << 8) | msg[4];
-	temp -= 400 + 320;
-	temp = (temp * 5) / 9;
-	if (msg[3] & 0x08) temp *= -1;
-	uint8_t hum = msg[5];
-	uint8_t bat = msg[3] & 0x80;
-	uint8_t station = msg[2];
-	uint8_t channel = (msg[3] >> 4) & 7;
-
-	if (chk == msg[6]) {
-		if (0)
-			printf("%% Station:%3d Chan: %d Hum:%2d%% Temp:%2d.%dC %s\n",
-				station, channel, hum,
-				temp / 10, temp % 10,
-				bat ? " LOW BAT":"");
-
+	log_printf(log_Warn, "%s %s rate limited, backoff %ums, %u dropped\n",
+			dir, topic, b->backoff, b->dropped);
 #ifdef MQTT
-		char *root;
-		if (mqtt_weather_name[channel].name)
-			asprintf(&root, "%s/sensor/%s", mqtt_root, mqtt_weather_name[channel].name);
-		else
-			asprintf(&root, "%s/sensor/%d", mqtt_root, channel);
-
-		char *v;
-		asprintf(&v, "{"
-				"\"c\":%d.%d,"
-				"\"h\":%d,"
-				"\"lbat\":%s,"
-				"\"ch\":%d"
-				"}"
-				,
-				temp / 10, temp % 10,
-				hum,
-				bat ? "true":"false",
-				channel
-			);
-		printf("%s %s\n", root, v);
-		mosquitto_publish(mosq, NULL, root, strlen(v), v, 1, true);
+	char *alert, *v;
+	asprintf(&alert, "%s/alert", mqtt_root);
+	asprintf(&v, "{"
+			"\"topic\":\"%s\","
+			"\"dir\":\"%s\","
+			"\"backoff\":%u,"
+			"\"dropped\":%u"
+			"}",
+			topic, dir, b->backoff, b->dropped);
+	mosquitto_publish(mosq, NULL, alert, strlen(v), v, 1, false);
+	free(alert);
+	free(v);
 #endif
-
-	}
 }
 
-
-void
-pulse_decoder(
-		msg_p m,
-		msg_p o)
+static void
+weather_publish(
+		weather_p w)
 {
-	uint8_t end = m->bytecount;
-	uint8_t start = 0;
-	uint8_t pi = 0;
-
-	uint8_t syncstart = 0;
-	uint8_t syncduration = 0;
-	uint8_t synclen = 0;
-	uint8_t manchester = 0;
-
-	typedef uint8_t pulse_t[2];
-	pulse_t *pulse = (pulse_t *)m->msg;
-
-	/*
-	 * Search for 8 pulses of ~equal duration. Even manchester starts with
-	 * at least 8 of them like that, while ASK will always be at least
-	 * 8 bits anyway, so it's a good discriminant
-	 */
-	while (pi != end && synclen < 8) {
-		uint8_t d = pulse[pi][0] + pulse[pi][1];
-		if (d < 12 || abs_sub(d, syncduration) > 8) {
-			syncstart = pi;
-			syncduration = d;
-			synclen = 0;
-			manchester = 0;
-		} else {
-			if (abs_sub(pulse[pi][1], pulse[pi][0]) < 12)
-				manchester++;
-			else
-				manchester = 0;
-			if (debug_sync > 1)
-				printf("sync %d delta %d/%d = %d\n", synclen,
-					syncduration, d, syncduration - d);
-			/* Integrate half the difference with previous cycle,
-			 * turns out some transmitter start a bit sluggish
-			 * and gradually get to 'speed' */
-			syncduration += (d - syncduration) / 2;
-			synclen++;
-		}
-		pi++;
-	}
-	if (debug_sync)
-		printf("syncstart %d synclen = %d, manchester: %d\n", syncstart,
-			synclen, manchester);
-	if (pi == end) {
-		printf("MN:%d\n", ovf_sub(start, end));
-		return;
-	}
-	msg_init(o, manchester ? 'M' : 'A');
-	o->pulse_duration = syncduration;
-	o->decoded = 1;
-
-	if (!manchester) {
-		pi = syncstart;
-		while (pi != end) {
-			uint8_t bit = pulse[pi][1] > pulse[pi][0];
-			msg_stuffbit(o, bit);
-			pi++;
-		}
-	} else {
-		// We know what a half pulse is, it's synclen / 2
-		pi = syncstart + (synclen - manchester);
-		if (synclen - manchester)
-			printf("** Adjusted start %d huh %d\n", pi,
-					synclen - manchester);
-		uint8_t bit = 0, phase = 1;
-		uint8_t demiclock = 0;
-		uint8_t stuffclock = 0;
-		uint8_t margin = o->pulse_duration / 4;
-
-		/*
-		 * Could demi-clocks; stuff the current bit value at each cycles,
-		 * and change the bit values when we get a phase that is more than
-		 * a demi synclen.
-		 */
-		while (pi != end) {
-			if (stuffclock != demiclock) {
-				if (stuffclock & 1)
-					msg_stuffbit(o, bit);
-				stuffclock++;
-			}
-			// if the phase is double the demiclock, change polarity
-			if (abs_sub(pulse[pi][phase], syncduration) < margin) {
-				bit = phase;
-				demiclock++;
-			}
-			demiclock++;
-			if (stuffclock != demiclock) {
-				if (stuffclock & 1)
-					msg_stuffbit(o, bit);
-				stuffclock++;
-			}
+	if (0)
+		log_printf(log_Info, "%% Station:%3d Chan: %d Hum:%2d%% Temp:%2d.%dC %s\n",
+			w->station, w->channel, w->hum,
+			w->temp / 10, w->temp % 10,
+			w->bat ? " LOW BAT":"");
 
-			if (phase == 0) pi++;
-			phase = !phase;
-		}
-	}
+#ifdef MQTT
+	char *root;
+	if (mqtt_weather_name[w->channel].name)
+		asprintf(&root, "%s/sensor/%s", mqtt_root, mqtt_weather_name[w->channel].name);
+	else
+		asprintf(&root, "%s/sensor/%d", mqtt_root, w->channel);
+
+	char *v;
+	asprintf(&v, "{"
+			"\"c\":%d.%d,"
+			"\"h\":%d,"
+			"\"lbat\":%s,"
+			"\"ch\":%d"
+			"}"
+			,
+			w->temp / 10, w->temp % 10,
+			w->hum,
+			w->bat ? "true":"false",
+			w->channel
+		);
+	log_printf(log_Info, "%s %s\n", root, v);
+	mosquitto_publish(mosq, NULL, root, strlen(v), v, 1, true);
+	state_set(root, v, gettime_ms());
+#endif
 }
 
 static void
 display(
 		msg_p m )
 {
-	if (m->bitcount >= 64) {
-		// look for weather sensor
-
-		/* idea here is to shift the header around to try to find the constant
-		 * header, and if found, we offset the whole buffer to match */
-		uint16_t *ml = (uint16_t*)m->msg;
-		int shift = 0;
-		for (int i = 0; i < 8; i++, shift++) {
-			uint32_t w = (ntohs(ml[0]) << (8 - shift)) |
-							(ntohs(ml[1]) >> (8 + shift));
-
-			if (w == 0x0145) {
-				// weather station message is shifted by that amount
-				msg_shift(m, shift);
-
-			//	printf("Weather %08x shift %d bcount %d\n", w, shift, bcount);
-				weather_decode(m);
-				break;
-			}
-		}
+	// look for weather sensor
+	if (weather_find(m) == 0) {
+		weather_t w;
+
+		if (weather_decode(m, &w) == 0)
+			weather_publish(&w);
 	}
 	if (m->decoded)
-		msg_display(stdout, m, "");
+		log_msg(log_Info, m, "");
+	char code[64];
+	if (msg_tristate(m, code, sizeof(code)) > 0)
+		log_printf(log_Info, "tristate %s\n", code);
 }
 
 
 #ifdef MQTT
+static bucket_t tx_global;
+
 /*
  * We use a cheap trick for detecting on/off and also messages that have been
  * sent by /us/ (so we don't create a feedback loop)
  */
+/* is 'topic' one we transmit for; called with match_lock held */
+static int
+mq_mapped(
+		const char * topic)
+{
+	for (msg_scene_t * s = scenes; s; s = s->next)
+		if (!strcmp(topic, s->mqtt_path))
+			return 1;
+	for (msg_match_t * m = matches; m; m = m->next)
+		if (!strcmp(topic, m->mqtt_path))
+			return 1;
+	return 0;
+}
+
 static void
 mq_message_cb(
 		struct mosquitto *mosq,
@@ -319,44 +197,170 @@ mq_message_cb(
 		const struct mosquitto_message *message )
 {
 	int flags = 0;
-
+	int tl = strlen(message->topic);
+	/*
+	 * Retained messages are the broker replaying states when we
+	 * (re)connect, they can wait behind someone pressing a button
+	 */
+	int cls = message->retain ? tx_Bulk : tx_Interactive;
+
+	/* state queries are answered from the cache, on <topic>/state */
+	if (tl > 4 && !strcmp(message->topic + tl - 4, "/get")) {
+		char topic[tl + 8];
+		char pload[512];
+
+		sprintf(topic, "%.*s", tl - 4, message->topic);
+		int pl = state_get(topic, pload, sizeof(pload));
+		log_printf(log_Info, ">> %s %s\n", message->topic,
+				pl < 0 ? "(unknown)" : pload);
+		if (pl < 0)
+			return;
+		strcat(topic, "/state");
+		mosquitto_publish(mosq, NULL, topic, pl, pload, 0, false);
+		return;
+	}
+	/* the readers update the mappings too; match_lock, then state_lock */
+	pthread_mutex_lock(&match_lock);
+	/* we get everything under the root, most of it we published */
+	if (!mq_mapped(message->topic))
+		goto done;
 	if (message->payloadlen) {
 		/* if it's US having received it via RF and published, ignore it */
 		if (strstr(message->payload, "\"src\":\"rf\""))
-			return;
+			goto done;
 		if (strstr(message->payload, "\"on\":true"))
 			flags |= 1;
 		if (strstr(message->payload, "\"on\":false"))
 			flags |= 2;
-		printf(">> %s %s\n", message->topic, (char*)message->payload);
+		if (strstr(message->payload, "\"prio\":\"bulk\""))
+			cls = tx_Bulk;
+		if (strstr(message->payload, "\"prio\":\"interactive\""))
+			cls = tx_Interactive;
+		log_printf(log_Info, ">> %s %s\n", message->topic, (char*)message->payload);
 	}
 
-	msg_match_t * m = matches;
-	while (m) {
+	/* scenes go out as one burst */
+	for (msg_scene_t * s = scenes; s; s = s->next) {
+		if (strcmp(message->topic, s->mqtt_path))
+			continue;
+		uint64_t now = gettime_ms();
+		int r = bucket_take(&tx_global, &rate_tx_global, now);
+		if (r == rate_Tripped)
+			rate_alert("tx", "*", &tx_global);
+		if (r != rate_Ok)
+			goto done;
+		tx_job_p j = tx_job_new(s->count, s->mqtt_path);
+		j->cls = cls;
+		for (int i = 0; i < s->count; i++) {
+			j->frame[i] = s->frame[i];
+			/* the devices we know about will be in that state */
+			msg_match_t * m = match_find(matches, s->frame[i]);
+			for (; m; m = match_find(m->next, s->frame[i])) {
+				m->last = now;
+				if (m->mqtt_pload)
+					state_set(m->mqtt_path, m->mqtt_pload, now);
+			}
+		}
+		tx_queue(j);
+		goto done;
+	}
+
+	for (msg_match_t * m = matches; m; m = m->next) {
 		if (!strcmp(message->topic, m->mqtt_path)) {
 			if (m->pload_flags == flags) {
 				uint64_t now = gettime_ms();
 				if (now - m->last > 500) {
 					m->last = now;
-					msg_display(stdout, &m->msg, "SEND");
-
-					/* I feel slightly dirty here, but it allows
-					 * the serial port to stay available for writing commands
-					 * and stuff, and /normally/ messages aren't that often.
-					 * I'm sure linux will cope..?
-					 */
-					FILE *o = fopen(serial_path, "w");
-
-					if (o) {
-						msg_display(o, &m->msg, "");
-						fclose(o);
-						usleep(200000);
+					int r = bucket_take(&tx_global, &rate_tx_global, now);
+					if (r == rate_Tripped)
+						rate_alert("tx", "*", &tx_global);
+					if (r == rate_Ok) {
+						r = bucket_take(&m->tx, &rate_tx_device, now);
+						if (r == rate_Tripped)
+							rate_alert("tx", m->mqtt_path, &m->tx);
 					}
+					/* the other mappings on that topic still go */
+					if (r != rate_Ok)
+						continue;
+					state_set(m->mqtt_path, message->payloadlen ?
+							(char*)message->payload : "", now);
+
+					tx_job_p j = tx_job_new(1, NULL);
+					j->frame[0] = &m->msg;
+					j->cls = cls;
+					tx_queue(j);
 				}
 			}
 		}
-		m = m->next;
 	}
+done:
+	pthread_mutex_unlock(&match_lock);
+}
+
+/* TX queue latency, per class, published at most every 10s */
+static void
+mq_tx_stats(
+		uint64_t now)
+{
+	static uint64_t last = 0;
+	static const char * names[tx_ClassCount] = {
+			[tx_Interactive] = "interactive", [tx_Bulk] = "bulk" };
+	if (now - last < 10000)
+		return;
+	last = now;
+
+	char v[512];
+	int l = sprintf(v, "{");
+	for (int c = 0; c < tx_ClassCount; c++) {
+		tx_stats_t st;
+		tx_get_stats(c, &st);
+		l += sprintf(v + l, "%s\"%s\":{"
+				"\"jobs\":%u,"
+				"\"frames\":%u,"
+				"\"dropped\":%u,"
+				"\"preempted\":%u,"
+				"\"wait_avg\":%u,"
+				"\"wait_max\":%u,"
+				"\"run_avg\":%u,"
+				"\"run_max\":%u"
+				"}",
+				c ? "," : "", names[c],
+				st.jobs, st.frames, st.dropped, st.preempted,
+				st.jobs ? (unsigned)(st.wait_total / st.jobs) : 0, st.wait_max,
+				st.jobs ? (unsigned)(st.run_total / st.jobs) : 0, st.run_max);
+	}
+	sprintf(v + l, "}");
+	char *topic;
+	asprintf(&topic, "%s/tx/stats", mqtt_root);
+	log_printf(log_Info, "%s %s\n", topic, v);
+	mosquitto_publish(mosq, NULL, topic, strlen(v), v, 0, true);
+	free(topic);
+}
+
+/* Publish completion of scenes */
+static void
+mq_tx_done(
+		tx_job_p j,
+		uint64_t now)
+{
+	mq_tx_stats(now);
+	if (!j->done_topic)
+		return;
+	char *done, *v;
+	asprintf(&done, "%s/done", j->done_topic);
+	asprintf(&v, "{"
+			"\"frames\":%d,"
+			"\"errors\":%d,"
+			"\"ms\":%u,"
+			"\"deferred\":%u,"
+			"\"dropped\":%s"
+			"}",
+			j->count, j->errors, (unsigned)(now - j->queued), j->deferred,
+			j->dropped ? "true" : "false");
+	log_printf(log_Info, "%s %s\n", done, v);
+	mosquitto_publish(mosq, NULL, done, strlen(v), v, 1, false);
+	free(done);
+	free(v);
 }
 
 static void
@@ -370,16 +374,276 @@ mq_connect_cb(
 		return;
 	}
 
-	msg_match_t * m = matches;
-	while (m) {
-		mosquitto_subscribe(mosq, NULL, m->mqtt_path, 2);
-		m = m->next;
-	}
+	/*
+	 * One subscription for the mapped topics and the <topic>/get queries,
+	 * whatever their depth; overlapping ones can get us the same message
+	 * twice.
+	 */
+	char *all;
+	asprintf(&all, "%s/#", mqtt_root);
+	mosquitto_subscribe(mosq, NULL, all, 2);
+	free(all);
 }
 #endif /* MQTT */
 
 
 
+/* learning mode, when 'learn_repeats' is set the firmware is in PULSE mode */
+static unsigned learn_repeats;
+static learn_t learner;
+
+/*
+ * A frame was seen enough times; tell what we worked out, and the line to
+ * paste in the mapping file, if the firmware can decode it.
+ * Called with match_lock held.
+ */
+static void
+learn_publish(
+		learn_result_p r)
+{
+	static unsigned learned;
+	msg_full_t u;
+
+	if (r->line[0] && msg_parse(&u.m, MSG_MAX_BYTES, r->line) == 0) {
+		msg_match_t *m = match_find(matches, &u.m);
+		if (m) {
+			log_printf(log_Debug, "LEARN %s already mapped to %s\n",
+					r->line, m->mqtt_path);
+			return;
+		}
+	}
+	char mapping[FW_LINE_SIZE] = "";
+	learn_mapping(r, mapping, sizeof(mapping));
+
+	char clusters[32];
+	int l = 0;
+	for (int i = 0; i < r->k; i++)
+		l += sprintf(clusters + l, "%s%u", i ? "," : "", r->center[i]);
+	log_printf(log_Info, "LEARN %s period %u (%uus) bits %u clusters %s "
+			"repeats %u\n",
+			learn_encoding_name(r->encoding), r->period, r->period_us, r->bits,
+			clusters, r->repeats);
+	if (*mapping)
+		log_printf(log_Info, "LEARN %s\tlearn/%u 2 {\"src\":\"rf\"}\n",
+				mapping, ++learned);
+	else
+		log_printf(log_Info, "LEARN no firmware decoder for it (%s)\n",
+				r->line[0] ? r->line : "nothing decoded");
+#ifdef MQTT
+	if (!mosq)
+		return;
+	char *topic, *v;
+	asprintf(&topic, "%s/learn", mqtt_root);
+	asprintf(&v, "{"
+			"\"encoding\":\"%s\","
+			"\"period\":%u,"
+			"\"period_us\":%u,"
+			"\"bits\":%u,"
+			"\"clusters\":[%s],"
+			"\"repeats\":%u,"
+			"\"line\":\"%s\","
+			"\"mapping\":\"%s\""
+			"}",
+			learn_encoding_name(r->encoding), r->period, r->period_us, r->bits,
+			clusters, r->repeats, r->line, mapping);
+	mosquitto_publish(mosq, NULL, topic, strlen(v), v, 1, false);
+	free(topic);
+	free(v);
+#endif
+}
+
+/* frames nobody mapped; called with match_lock held */
+static discover_t discovered;
+
+static void
+discover_publish(
+		uint64_t now)
+{
+	static uint64_t last;
+	if (!last)
+		last = now;
+	if (now - last < DISCOVER_REPORT_MS)
+		return;
+	last = now;
+
+	char v[2048];
+	discover_report(&discovered, DISCOVER_TOP, v, sizeof(v));
+	log_printf(log_Info, "DISCOVER %s\n", v);
+#ifdef MQTT
+	if (!mosq)
+		return;
+	char *topic;
+	asprintf(&topic, "%s/discover", mqtt_root);
+	mosquitto_publish(mosq, NULL, topic, strlen(v), v, 0, true);
+	free(topic);
+#endif
+}
+
+/* serial latency report, every minute */
+#define SERIAL_REPORT_MS	60000
+
+static void
+bridge_report(
+		bridge_p b)
+{
+	char v[256];
+	serial_report(&b->serial, v, sizeof(v));
+	log_printf(log_Info, "%s %s\n", b->path, v);
+#ifdef MQTT
+	if (!mosq)
+		return;
+	char *topic;
+	asprintf(&topic, "%s/serial/%d", mqtt_root, b->index);
+	mosquitto_publish(mosq, NULL, topic, strlen(v), v, 0, true);
+	free(topic);
+#endif
+}
+
+static void
+band_publish(
+		bridge_p b)
+{
+	char v[256];
+	band_report(&b->band, v, sizeof(v));
+	log_printf(log_Info, "%s band %s\n", b->path, v);
+#ifdef MQTT
+	if (!mosq)
+		return;
+	char *topic;
+	asprintf(&topic, "%s/band/%d", mqtt_root, b->index);
+	mosquitto_publish(mosq, NULL, topic, strlen(v), v, 0, true);
+	free(topic);
+#endif
+}
+
+/*
+ * SIGTERM (a systemd stop) or ^C; the readers never return for these,
+ * flush the state snapshot and leave
+ */
+static void *
+signal_thread(
+		void * param)
+{
+	int sig;
+
+	if (sigwait(param, &sig))
+		return NULL;
+	log_printf(log_Info, "%s, exiting\n", strsignal(sig));
+	state_sync(gettime_ms(), 1);
+	log_stop();
+	exit(0);
+}
+
+/*
+ * One of these per bridge. Messages heard by several bridges are only
+ * published once, the 500ms window takes care of that, but they all
+ * count toward how well each bridge hears that device.
+ */
+static void *
+bridge_reader(
+		void * param)
+{
+	bridge_p b = param;
+	char line[1024];
+
+	msg_full_t u;
+	uint64_t report = gettime_ms();
+	int len;
+	/* wake up every second, to ask for the band statistics in time */
+	while ((len = serial_getline(&b->serial, line, sizeof(line), 1000)) >= 0) {
+		uint64_t now = gettime_ms();
+		/* here too, what we transmitted changes the state, band or not */
+		state_sync(now, 0);
+		if (b->band.supported && now - b->band.asked >= BAND_PERIOD_MS &&
+				tx_query(b->index, "STATS\n") == 0)
+			b->band.asked = now;
+		if (!len)
+			continue;
+		// strip line
+		while (*line && line[strlen(line)-1] <= ' ')
+			line[strlen(line)-1] = 0;
+		if (!*line) continue;
+		if (bridge_count > 1)
+			log_printf(log_Raw, "%d:%s\n", b->index, line);
+		else
+			log_printf(log_Raw, "%s\n", line);
+		if (band_parse(&b->band, line, now)) {
+			if (b->band.window)
+				band_publish(b);
+			continue;
+		}
+		if (tx_ack(b->index, line))
+			continue;
+
+		if (msg_parse(&u.m, MSG_MAX_BYTES, line) != 0)
+			continue;
+
+		if (u.m.checksum_valid) {
+			msg_p d = &u.m;
+			msg_full_t full;
+			uint64_t now = gettime_ms();
+
+			pthread_mutex_lock(&match_lock);
+			/* bound what a noisy band can cost us */
+			int r = bucket_take(&rx_global, &rate_rx_global, now);
+			if (r == rate_Tripped)
+				rate_alert("rx", "*", &rx_global);
+			if (r != rate_Ok) {
+				pthread_mutex_unlock(&match_lock);
+				continue;
+			}
+
+			if (learn_repeats && d->pulses) {
+				learn_result_t lr;
+				if (learn_frame(&learner, d, now, &lr))
+					learn_publish(&lr);
+			}
+			if (d->bitcount && d->pulses) {
+				pulse_decoder(d, &full.m);
+				d = &full.m;
+			}
+			display(d);
+
+			msg_match_t *m = match_find(matches, d);
+			if (!m && d->bitcount && !d->pulses && d->type != 'N')
+				discover_add(&discovered, d, now);
+			discover_publish(now);
+			while (m) {
+				if (now - m->last > 500) {
+					r = bucket_take(&m->rx, &rate_rx_device, now);
+					if (r == rate_Tripped)
+						rate_alert("rx", m->mqtt_path, &m->rx);
+#ifdef MQTT
+					if (r == rate_Ok) {
+						mosquitto_publish(mosq, NULL,
+								m->mqtt_path,
+								strlen(m->mqtt_pload), m->mqtt_pload,
+								1, true);
+						log_printf(log_Info, "%s %s\n", m->mqtt_path, m->mqtt_pload);
+					}
+#endif
+				}
+				if (m->mqtt_pload)
+					state_set(m->mqtt_path, m->mqtt_pload, now);
+				m->last = now;
+				/* the clock drift vs the mapping tells how clean that was */
+				link_update(&m->link[b->index],
+						abs_sub(d->pulse_duration, m->msg.pulse_duration),
+						now);
+				m = match_find(m->next, d);
+			}
+			pthread_mutex_unlock(&match_lock);
+			serial_done(&b->serial);
+			if (now - report > SERIAL_REPORT_MS) {
+				report = now;
+				bridge_report(b);
+			}
+		}
+	}
+	serial_close(&b->serial);
+	return NULL;
+}
+
 int
 main(
 		int argc,
@@ -388,6 +652,7 @@ main(
 	const char *mqtt_hostname = NULL;
 	const char *mqtt_password = NULL;
 	const char *mapping_path = NULL;
+	const char *state_path = NULL;
 	char line[1024];
 
 	for (int i = 1; i < argc; i++) {
@@ -399,21 +664,42 @@ main(
 			mqtt_password = argv[++i];
 		} else if (!strcmp(argv[i], "-m") && i < (argc-1)) {
 			mapping_path = argv[++i];
-		} else if (!serial_path)
-			serial_path = argv[i];
-		else {
+		} else if (!strcmp(argv[i], "-S") && i < (argc-1)) {
+			state_path = argv[++i];
+		} else if (!strcmp(argv[i], "-l") && i < (argc-1)) {
+			log_level = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-s") && i < (argc-1)) {
+			log_raw_sample = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-P") && i < (argc-1)) {
+			learn_repeats = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-L")) {
+			serial_low_latency = 1;
+		} else if (argv[i][0] == '-') {
 			fprintf(stderr, "%s invalid argument %s\n", argv[0], argv[i]);
 			exit(1);
+		} else if (bridge_add(argv[i]) < 0) {
+			fprintf(stderr, "%s too many bridges, max %d\n", argv[0], BRIDGE_MAX);
+			exit(1);
 		}
 	}
-	if (argc == 1 || !serial_path) {
+	if (argc == 1 || !bridge_count) {
 		fprintf(stderr,
 				"%s: [-h <mqtt_hostname>] [-p <mtqq_password>] "
 				"[-r <mqtt root name>] [-m <message mapping filename] "
-				"<serial port device file>\n",
+				"[-l <log level 0-4>] [-s <log one raw line every n>] "
+				"[-S <state snapshot filename>] [-L (low latency serial)] "
+				"[-P <repeats> (learning mode)] "
+				"<serial port device file> [<serial port device file>...]\n",
 				argv[0]);
 		exit(1);
 	}
+	/* the threads inherit that, only signal_thread() gets them */
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	log_start(stdout);
 	if (mapping_path) {
 		fileio_t f = {
 				.f = fopen(mapping_path, "r"),
@@ -439,6 +725,38 @@ main(
 		}
 		fclose(f.f);
 	}
+	if (state_path && state_load(state_path))
+		log_printf(log_Warn, "%s: no state snapshot yet\n", state_path);
+	pthread_t sig_thread;
+	pthread_create(&sig_thread, NULL, signal_thread, &sigs);
+	if (serial_low_latency)
+		serial_realtime_init();
+	/* measure the round trips now, before the TX thread uses the ports */
+	for (int i = 0; i < bridge_count; i++) {
+		if (serial_open(&bridge[i].serial, bridge[i].path)) {
+			perror(bridge[i].path);
+			exit(1);
+		}
+		if (serial_ping(&bridge[i].serial, SERIAL_PINGS) <= 0)
+			log_printf(log_Warn, "%s: firmware not answering\n", bridge[i].path);
+		else {
+			if (serial_flow(&bridge[i].serial) == 0)
+				log_printf(log_Debug, "%s: %u bytes receive FIFO\n",
+						bridge[i].path, bridge[i].serial.rx_fifo);
+			if (band_probe(&bridge[i]))
+				log_printf(log_Debug, "%s: no band statistics\n",
+						bridge[i].path);
+		}
+		bridge_report(&bridge[i]);
+		/* not PACK, it rounds the phases to it's table, the clusters
+		 * would only ever see those */
+		if (learn_repeats &&
+				serial_command(&bridge[i].serial, "PULSE\n"))
+			log_printf(log_Warn, "%s: can't switch to PULSE mode\n",
+					bridge[i].path);
+	}
+	if (learn_repeats)
+		learn_init(&learner, learn_repeats);
 #ifdef MQTT
 	if (!mqtt_hostname)
 		mqtt_hostname = getenv("MQTT");
@@ -462,6 +780,8 @@ main(
 		if (mqtt_password)
 			mosquitto_username_pw_set(mosq, hn, mqtt_password);
 
+		tx_done = mq_tx_done;
+		tx_start();
 		mosquitto_connect_callback_set(mosq, mq_connect_cb);
 		mosquitto_message_callback_set(mosq, mq_message_cb);
 
@@ -471,7 +791,7 @@ main(
 			exit(1);
 		}
 		mosquitto_loop_start(mosq);
-		printf("MQTT started\n");
+		log_printf(log_Info, "MQTT started\n");
 	}
 #else
 	if (mqtt_hostname) {
@@ -479,64 +799,11 @@ main(
 		exit(1);
 	}
 #endif
-	/* in case it's a serial port do stuff to it */
-	{
-		const char * stty =
-			"stty 115200 -clocal -icanon -hupcl -cread -opost -echo <%s >/dev/null 2>&1";
-		char * d = malloc(strlen(stty) + strlen(serial_path) + 10);
-
-		sprintf(d, stty, serial_path);
-		printf("%s\n", d);
-		if (system(d))
-			;	// ok to fail
-		free(d);
-	}
-	FILE * f = fopen(serial_path, "r");
-	if (!f) {
-		perror(serial_path);
-		exit(1);
-	}
-	msg_full_t u;
-	while (fgets(line, sizeof(line), f)) {
-		// strip line
-		while (*line && line[strlen(line)-1] <= ' ')
-			line[strlen(line)-1] = 0;
-		if (!*line) continue;
-		printf("%s\n", line);
-
-		if (msg_parse(&u.m, 512, line) != 0)
-			continue;
-
-		if (u.m.checksum_valid) {
-			msg_p d = &u.m;
-			msg_full_t full;
-
-			if (d->bitcount && d->pulses) {
-				pulse_decoder(d, &full.m);
-				d = &full.m;
-			}
-			display(d);
-
-			msg_match_t *m = matches;
-			uint16_t want = ((uint16_t*)d->msg)[0];
-			uint64_t now = gettime_ms();
-			while (m) {
-				if (*((uint16_t*)m->msg.msg) == want &&
-						!memcmp(m->msg.msg, d->msg, d->bytecount)) {
-					if (now - m->last > 500) {
-#ifdef MQTT
-						mosquitto_publish(mosq, NULL,
-								m->mqtt_path,
-								strlen(m->mqtt_pload), m->mqtt_pload,
-								1, true);
-						printf("%s %s\n", m->mqtt_path, m->mqtt_pload);
-#endif
-					}
-					m->last = now;
-				}
-				m = m->next;
-			}
-		}
-	}
-	fclose(f);
+	for (int i = 0; i < bridge_count; i++)
+		serial_thread(&bridge[i].thread, bridge_reader, &bridge[i]);
+	for (int i = 0; i < bridge_count; i++)
+		pthread_join(bridge[i].thread, NULL);
+	tx_stop();
+	state_sync(gettime_ms(), 1);
+	log_stop();
 }
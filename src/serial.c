@@ -0,0 +1,292 @@
+/*
+ * serial.c
+ *
+ *  Created on: 17 Oct 2026
+ *
+ * Replaces the old 'stty' + stdio reader. Lines vary from 4 bytes (acks)
+ * to 1KB (raw pulses) so we don't try to frame them with VMIN/VTIME; we
+ * ask for a wakeup as soon as anything arrives (VMIN 1, VTIME 0) and
+ * split the lines ourselves.
+ * The firmware uses XON/XOFF when it's receive FIFO fills up, the tty
+ * layer takes care of it (IXON); writes just block meanwhile.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sched.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+#include "serial.h"
+#include "log.h"
+#include "utils.h"
+
+int serial_low_latency = 0;
+
+int
+serial_open(
+		serial_p s,
+		const char * path)
+{
+	memset(s, 0, sizeof(*s));
+	s->rx_fifo = SERIAL_RX_FIFO;
+	s->fd = open(path, O_RDWR | O_NOCTTY);
+	if (s->fd < 0)
+		return -1;
+
+	struct termios t;
+	if (tcgetattr(s->fd, &t))
+		return 0;	// not a tty, a capture file perhaps
+	cfmakeraw(&t);
+	cfsetispeed(&t, B115200);
+	cfsetospeed(&t, B115200);
+	t.c_cflag |= CREAD | CLOCAL;
+	t.c_cflag &= ~HUPCL;	// don't reset the arduino every time
+	t.c_iflag |= IXON;
+	t.c_iflag &= ~IXANY;
+	t.c_cc[VSTART] = 0x11;
+	t.c_cc[VSTOP] = 0x13;
+	t.c_cc[VMIN] = 1;
+	t.c_cc[VTIME] = 0;
+	if (tcsetattr(s->fd, TCSANOW, &t))
+		log_printf(log_Warn, "%s: %s\n", path, strerror(errno));
+#if defined(TIOCGSERIAL) && defined(ASYNC_LOW_LATENCY)
+	/* on FTDIs this drops the latency timer from 16ms to 1ms */
+	if (serial_low_latency) {
+		struct serial_struct ss;
+		if (ioctl(s->fd, TIOCGSERIAL, &ss) == 0) {
+			ss.flags |= ASYNC_LOW_LATENCY;
+			if (ioctl(s->fd, TIOCSSERIAL, &ss))
+				log_printf(log_Warn, "%s: low latency: %s\n",
+						path, strerror(errno));
+		}
+	}
+#endif
+	return 0;
+}
+
+void
+serial_close(
+		serial_p s)
+{
+	if (s->fd >= 0)
+		close(s->fd);
+	s->fd = -1;
+}
+
+int
+serial_getline(
+		serial_p s,
+		char * line,
+		size_t size,
+		int timeout)
+{
+	do {
+		char * nl = memchr(s->buf, '\n', s->len);
+		if (s->skip) {
+			/* the tail of a line returned truncated, up to it's '\n' */
+			int l = nl ? nl - s->buf + 1 : s->len;
+			s->skip = !nl;
+			s->len -= l;
+			memmove(s->buf, s->buf + l, s->len);
+			nl = memchr(s->buf, '\n', s->len);
+		}
+		/* too long, return it truncated and drop the rest */
+		if (!nl && s->len == sizeof(s->buf)) {
+			nl = s->buf + s->len - 1;
+			s->skip = 1;
+		}
+		if (nl) {
+			int l = nl - s->buf + 1;
+			int c = l < size ? l : size - 1;
+			memcpy(line, s->buf, c);
+			line[c] = 0;
+			s->len -= l;
+			memmove(s->buf, s->buf + l, s->len);
+			s->stats.lines++;
+			return l;
+		}
+		if (timeout >= 0) {
+			struct pollfd p = { .fd = s->fd, .events = POLLIN };
+			int r = poll(&p, 1, timeout);
+			if (r == 0)
+				return 0;
+			if (r < 0 && errno != EINTR)
+				return -1;
+		}
+		ssize_t r = read(s->fd, s->buf + s->len, sizeof(s->buf) - s->len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			if (!s->len)
+				return -1;
+			s->buf[s->len++] = '\n';	// last line, without a newline
+			continue;
+		}
+		s->stamp = gettime_us();
+		s->len += r;
+	} while (1);
+}
+
+int
+serial_ping(
+		serial_p s,
+		int count)
+{
+	char line[64];
+	/*
+	 * the first one can take a while, the arduino resets when opened, it
+	 * only syncs us with the firmware and is not accounted
+	 */
+	int timeout = 2000;
+
+	for (int i = 0; i <= count; i++) {
+		uint64_t start = gettime_us();
+		/* DEMOD is the default mode, it's a no-op that returns "*OK" */
+		if (write(s->fd, "DEMOD\n", 6) != 6)
+			return -1;
+		int l;
+		while ((l = serial_getline(s, line, sizeof(line), timeout)) > 0)
+			if (!strncmp(line, "*OK", 3))
+				break;
+		if (l < 0)
+			return -1;
+		if (l == 0)
+			continue;
+		timeout = 500;
+		if (i == 0)
+			continue;
+		unsigned rtt = s->stamp - start;
+		if (!s->stats.pings || rtt < s->stats.rtt_min)
+			s->stats.rtt_min = rtt;
+		if (rtt > s->stats.rtt_max)
+			s->stats.rtt_max = rtt;
+		s->stats.rtt_total += rtt;
+		s->stats.pings++;
+	}
+	/* these aren't real lines */
+	s->stats.lines = 0;
+	return s->stats.pings;
+}
+
+int
+serial_command(
+		serial_p s,
+		const char * cmd)
+{
+	char line[64];
+	int l = strlen(cmd);
+
+	if (write(s->fd, cmd, l) != l)
+		return -1;
+	while ((l = serial_getline(s, line, sizeof(line), 500)) > 0)
+		if (!strncmp(line, "*OK", 3))
+			return 0;
+	return -1;
+}
+
+int
+serial_flow(
+		serial_p s)
+{
+	char line[64];
+	int l;
+
+	s->rx_fifo = SERIAL_RX_FIFO;
+	if (write(s->fd, "FLOW\n", 5) != 5)
+		return -1;
+	/* older firmwares ignore it, and don't reply at all */
+	while ((l = serial_getline(s, line, sizeof(line), 500)) > 0) {
+		if (line[0] == '*' && line[1] == 'F') {
+			unsigned v = strtoul(line + 2, NULL, 16);
+			if (v >= 8)
+				s->rx_fifo = v;
+			s->flow = 1;
+			return 0;
+		}
+		if (line[0] == '!')
+			break;
+	}
+	return -1;
+}
+
+void
+serial_done(
+		serial_p s)
+{
+	unsigned proc = gettime_us() - s->stamp;
+	s->stats.handled++;
+	s->stats.proc_total += proc;
+	if (proc > s->stats.proc_max)
+		s->stats.proc_max = proc;
+}
+
+/*
+ * The end to end estimate is half the round trip (firmware to us) plus
+ * the time we take to handle a line.
+ */
+int
+serial_report(
+		serial_p s,
+		char * dst,
+		size_t size)
+{
+	serial_stats_t * st = &s->stats;
+	unsigned rtt = st->pings ? st->rtt_total / st->pings : 0;
+	unsigned proc = st->handled ? st->proc_total / st->handled : 0;
+
+	return snprintf(dst, size, "{"
+			"\"low_latency\":%s,"
+			"\"lines\":%u,"
+			"\"handled\":%u,"
+			"\"rtt_min\":%u,"
+			"\"rtt_avg\":%u,"
+			"\"rtt_max\":%u,"
+			"\"proc_avg\":%u,"
+			"\"proc_max\":%u,"
+			"\"latency\":%u"
+			"}",
+			serial_low_latency ? "true" : "false",
+			st->lines, st->handled, st->rtt_min, rtt, st->rtt_max,
+			proc, st->proc_max, (rtt / 2) + proc);
+}
+
+void
+serial_realtime_init()
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		log_printf(log_Warn, "mlockall: %s\n", strerror(errno));
+}
+
+int
+serial_thread(
+		pthread_t * t,
+		void *(*func)(void *),
+		void * param)
+{
+	if (serial_low_latency) {
+		pthread_attr_t attr;
+		struct sched_param p = { .sched_priority = SERIAL_RT_PRIORITY };
+
+		pthread_attr_init(&attr);
+		/* with mlockall, the default 8MB stack would be all locked */
+		pthread_attr_setstacksize(&attr, 256 * 1024);
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &p);
+		int res = pthread_create(t, &attr, func, param);
+		pthread_attr_destroy(&attr);
+		if (!res)
+			return 0;
+		log_printf(log_Warn, "SCHED_FIFO reader: %s\n", strerror(res));
+	}
+	return pthread_create(t, NULL, func, param);
+}
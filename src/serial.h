@@ -0,0 +1,122 @@
+/*
+ * serial.h
+ *
+ *  Created on: 17 Oct 2026
+ */
+
+#ifndef _SERIAL_H_
+#define _SERIAL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Serial port to a bridge. The port is configured with termios directly,
+ * and read without stdio so we know when each line arrived.
+ */
+typedef struct serial_stats_t {
+	unsigned	lines;
+	unsigned	pings;			// answered, at startup
+	unsigned	rtt_min, rtt_max;	// us, ping round trip
+	uint64_t	rtt_total;
+	unsigned	handled;		// frames that got to the mapping
+	unsigned	proc_max;		// us, line received to handled
+	uint64_t	proc_total;
+} serial_stats_t;
+
+typedef struct serial_t {
+	int			fd;
+	uint64_t	stamp;			// gettime_us() of the read() that completed the line
+	unsigned	rx_fifo;		// size of the firmware receive FIFO
+	uint8_t		flow;			// the firmware answers FLOW
+	serial_stats_t	stats;
+	int			len;
+	int			skip;			// dropping the rest of a too long line
+	char		buf[2048];
+} serial_t, *serial_p;
+
+/*
+ * Low latency mode; asks the USB serial drivers to flush immediately
+ * (ASYNC_LOW_LATENCY) and runs the readers as SCHED_FIFO threads
+ */
+extern int serial_low_latency;
+
+#define SERIAL_RT_PRIORITY	50
+/* number of round trips measured when opening a bridge */
+#define SERIAL_PINGS		8
+/* receive FIFO of the firmwares that don't say */
+#define SERIAL_RX_FIFO		32
+
+int
+serial_open(
+		serial_p s,
+		const char * path);
+
+void
+serial_close(
+		serial_p s);
+
+/*
+ * Get the next line (including it's '\n') in 'line', waiting at most
+ * 'timeout' ms, or forever if -1. Returns the line length, 0 on timeout,
+ * -1 at the end of the file.
+ */
+int
+serial_getline(
+		serial_p s,
+		char * line,
+		size_t size,
+		int timeout);
+
+/*
+ * Measure the round trip to the firmware with 'count' no-op commands, to
+ * be called before anyone else uses the port.
+ */
+int
+serial_ping(
+		serial_p s,
+		int count);
+
+/*
+ * Send command 'cmd' (with it's '\n') and wait for the firmware "*OK",
+ * to be called before anyone else uses the port. Returns 0 if acknowledged.
+ */
+int
+serial_command(
+		serial_p s,
+		const char * cmd);
+
+/*
+ * Ask the firmware the size of it's receive FIFO, in s->rx_fifo; it's
+ * SERIAL_RX_FIFO if it doesn't know the FLOW command. To be called before
+ * anyone else uses the port.
+ */
+int
+serial_flow(
+		serial_p s);
+
+/* account the time spent handling the frame in the last line */
+void
+serial_done(
+		serial_p s);
+
+/* format the latency report as JSON */
+int
+serial_report(
+		serial_p s,
+		char * dst,
+		size_t size);
+
+/* lock our memory, in low latency mode; call once */
+void
+serial_realtime_init();
+
+/* start a (real time, in low latency mode) reader thread */
+int
+serial_thread(
+		pthread_t * t,
+		void *(*func)(void *),
+		void * param);
+
+#endif /* _SERIAL_H_ */
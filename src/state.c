@@ -0,0 +1,193 @@
+/*
+ * state.c
+ *
+ *  Created on: 17 Oct 2026
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "state.h"
+#include "utils.h"
+#include "log.h"
+
+/* don't rewrite the snapshot more than that often */
+#define STATE_SYNC_MS	10000
+
+static state_p states = NULL;
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+/* held over the whole snapshot write, it's not done under state_lock */
+static pthread_mutex_t state_sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char * state_path = NULL;
+static uint64_t state_synced = 0;
+static int state_dirty = 0;
+
+static state_p
+state_find(
+		const char * topic)
+{
+	state_p s = states;
+	while (s && strcmp(s->topic, topic))
+		s = s->next;
+	return s;
+}
+
+int
+state_set(
+		const char * topic,
+		const char * payload,
+		uint64_t now)
+{
+	int res = 0;
+	pthread_mutex_lock(&state_lock);
+	state_p s = state_find(topic);
+	if (!s) {
+		s = calloc(1, sizeof(*s) + strlen(topic) + 1);
+		strcpy(s->topic, topic);
+		s->next = states;
+		states = s;
+	}
+	if (!s->payload || strcmp(s->payload, payload)) {
+		free(s->payload);
+		s->payload = strdup(payload);
+		state_dirty = res = 1;
+	}
+	s->stamp = now;
+	pthread_mutex_unlock(&state_lock);
+	return res;
+}
+
+int
+state_get(
+		const char * topic,
+		char * dst,
+		int size)
+{
+	int res = -1;
+	pthread_mutex_lock(&state_lock);
+	state_p s = state_find(topic);
+	if (s && s->payload)
+		res = snprintf(dst, size, "%s", s->payload);
+	pthread_mutex_unlock(&state_lock);
+	return res;
+}
+
+/*
+ * The snapshot is a flat file, one "<topic>\t<payload>" per line. The
+ * payloads can have anything in them, the line breaks and backslashes are
+ * escaped as "\n", "\r" and "\\".
+ */
+static void
+state_unescape(
+		char * s)
+{
+	char * d = s;
+	for (; *s; s++) {
+		if (*s == '\\' && (s[1] == 'n' || s[1] == 'r' || s[1] == '\\')) {
+			s++;
+			*d++ = *s == 'n' ? '\n' : *s == 'r' ? '\r' : '\\';
+		} else
+			*d++ = *s;
+	}
+	*d = 0;
+}
+
+static void
+state_escape(
+		FILE * o,
+		const char * s)
+{
+	for (; *s; s++) {
+		if (*s == '\n')
+			fputs("\\n", o);
+		else if (*s == '\r')
+			fputs("\\r", o);
+		else if (*s == '\\')
+			fputs("\\\\", o);
+		else
+			fputc(*s, o);
+	}
+}
+
+int
+state_load(
+		const char * path)
+{
+	char line[1024];
+	state_path = path;
+	fileio_t f = {
+			.f = fopen(path, "r"),
+			.fname = path,
+	};
+	if (!f.f)
+		return -1;
+	while (fgets(line, sizeof(line), f.f)) {
+		f.linecount++;
+		while (*line && line[strlen(line)-1] <= ' ')
+			line[strlen(line)-1] = 0;
+		char * l = line;
+		const char * topic = strsep(&l, " \t");
+		if (!*topic || *topic == '#' || !l) {
+			if (*topic && *topic != '#')
+				log_printf(log_Warn, "%s:%d invalid state\n",
+						f.fname, f.linecount);
+			continue;
+		}
+		state_unescape(l);
+		state_set(topic, l, 0);
+	}
+	fclose(f.f);
+	state_dirty = 0;
+	return 0;
+}
+
+static int
+state_write(
+		uint64_t now)
+{
+	char tmp[strlen(state_path) + 8];
+	sprintf(tmp, "%s.tmp", state_path);
+	FILE * o = fopen(tmp, "w");
+	if (!o) {
+		log_printf(log_Error, "%s: can't write state\n", tmp);
+		state_synced = now;	// don't retry at every line
+		return -1;
+	}
+	pthread_mutex_lock(&state_lock);
+	for (state_p s = states; s; s = s->next)
+		if (s->payload) {
+			fprintf(o, "%s\t", s->topic);
+			state_escape(o, s->payload);
+			fputc('\n', o);
+		}
+	state_dirty = 0;
+	pthread_mutex_unlock(&state_lock);
+	fclose(o);
+	state_synced = now;
+	if (rename(tmp, state_path)) {
+		log_printf(log_Error, "%s: can't rename state\n", state_path);
+		return -1;
+	}
+	return 0;
+}
+
+int
+state_sync(
+		uint64_t now,
+		int force)
+{
+	int res = 0;
+
+	/* every reader calls that, only one gets to write the file */
+	pthread_mutex_lock(&state_sync_lock);
+	if (state_path && (force || now - state_synced >= STATE_SYNC_MS)) {
+		pthread_mutex_lock(&state_lock);
+		int dirty = state_dirty;
+		pthread_mutex_unlock(&state_lock);
+		if (dirty)
+			res = state_write(now);
+	}
+	pthread_mutex_unlock(&state_sync_lock);
+	return res;
+}
@@ -0,0 +1,57 @@
+/*
+ * state.h
+ *
+ *  Created on: 17 Oct 2026
+ */
+
+#ifndef _STATE_H_
+#define _STATE_H_
+
+#include <stdint.h>
+
+/*
+ * Last known state of each device, keyed by it's MQTT topic. Updated when
+ * we receive a frame from a device, and when we transmit one, so the
+ * daemon can answer <topic>/get itself.
+ */
+typedef struct state_t {
+	struct state_t *	next;
+	uint64_t			stamp;		// gettime_ms() of last update
+	char *				payload;
+	char				topic[];
+} state_t, *state_p;
+
+/*
+ * Set the state of 'topic' to 'payload', return 1 if it changed
+ */
+int
+state_set(
+		const char * topic,
+		const char * payload,
+		uint64_t now);
+
+/*
+ * Copy the state of 'topic' in 'dst', return it's length or -1 if
+ * unknown.
+ */
+int
+state_get(
+		const char * topic,
+		char * dst,
+		int size);
+
+/*
+ * Snapshot file; state_load() reads it back, and sets the path for
+ * state_sync() to write to when there are changes.
+ */
+int
+state_load(
+		const char * path);
+
+/* write the snapshot if it's dirty, and 'force' or it's been a while */
+int
+state_sync(
+		uint64_t now,
+		int force);
+
+#endif /* _STATE_H_ */
@@ -0,0 +1,540 @@
+/*
+ * tx.c
+ *
+ *  Created on: 17 Oct 2026
+ *
+ * Transmit thread. Jobs are queued by the MQTT thread, and sent here to
+ * the bridge. Instead of sleeping a fixed time after each frame, we wait
+ * for the firmware to acknowledge it ("*OK") which it does once it has
+ * finished transmitting, and we keep the next frames queued in the
+ * firmware UART FIFO in the meantime so there is no gap between frames.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "tx.h"
+#include "matches.h"
+#include "log.h"
+#include "utils.h"
+#include "fw_decode.h"
+
+/*
+ * The firmware acknowledges a frame once it has sent all it's repeats,
+ * so how long that takes depends on the frame, see tx_ack_timeout().
+ * This is for the rest; the line itself, the USB latency.
+ */
+#define TX_ACK_TIMEOUT_MS	1000
+/* listen before talk can defer a frame up to that, LBT_MAX_WAIT */
+#define TX_LBT_MAX_MS		500
+/*
+ * Frames sent ahead of the acknowledgements; they have to fit in the
+ * firmware uart_rx FIFO while the previous one is transmitted, that's
+ * one short frame on the 328p, a handful on the mega. Can't be more than
+ * 32, see tx.nack.
+ */
+#define TX_WINDOW			16
+
+void (*tx_done)(
+		tx_job_p j,
+		uint64_t now) = NULL;
+
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_t			thread;
+	int					running;
+	tx_job_p			head[tx_ClassCount], tail[tx_ClassCount];
+	tx_stats_t			stats[tx_ClassCount];
+	/* per bridge, for the current burst */
+	unsigned			acked[BRIDGE_MAX];
+	uint32_t			nack[BRIDGE_MAX];		// one bit per ack index
+	unsigned			deferred[BRIDGE_MAX];	// ms, reported by the firmware
+	uint8_t				busy[BRIDGE_MAX];		// a burst is going on
+	uint8_t				lost[BRIDGE_MAX];		// acks out of sync, see tx_resync()
+	unsigned			flows[BRIDGE_MAX];		// "*F" replies
+} tx = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+tx_job_p
+tx_job_new(
+		int count,
+		const char * done_topic)
+{
+	tx_job_p j = calloc(1, sizeof(*j) + (count * sizeof(j->frame[0])));
+	j->count = count;
+	j->done_topic = done_topic;
+	return j;
+}
+
+void
+tx_queue(
+		tx_job_p j)
+{
+	int c = j->cls < tx_ClassCount ? j->cls : tx_Bulk;
+	j->next = NULL;
+	j->queued = gettime_ms();
+	pthread_mutex_lock(&tx.lock);
+	if (tx.tail[c])
+		tx.tail[c]->next = j;
+	else
+		tx.head[c] = j;
+	tx.tail[c] = j;
+	pthread_cond_broadcast(&tx.cond);
+	pthread_mutex_unlock(&tx.lock);
+}
+
+void
+tx_get_stats(
+		int cls,
+		tx_stats_t * dst)
+{
+	pthread_mutex_lock(&tx.lock);
+	*dst = tx.stats[cls];
+	pthread_mutex_unlock(&tx.lock);
+}
+
+int
+tx_ack(
+		int b,
+		const char * line)
+{
+	int nack = line[0] == '!' && isdigit(line[1]);
+
+	/* firmware waited for the channel to be clear before transmitting */
+	if (line[0] == '*' && line[1] == 'D' && isxdigit(line[2])) {
+		pthread_mutex_lock(&tx.lock);
+		tx.deferred[b] += strtoul(line + 2, NULL, 16);
+		pthread_mutex_unlock(&tx.lock);
+		return 1;
+	}
+	/* the FLOW we sent to resync */
+	if (line[0] == '*' && line[1] == 'F' && isxdigit(line[2])) {
+		pthread_mutex_lock(&tx.lock);
+		tx.flows[b]++;
+		pthread_cond_broadcast(&tx.cond);
+		pthread_mutex_unlock(&tx.lock);
+		return 1;
+	}
+	if (strcmp(line, "*OK") && !nack)
+		return 0;
+	pthread_mutex_lock(&tx.lock);
+	uint32_t bit = 1 << (tx.acked[b] & 31);
+	tx.nack[b] = nack ? tx.nack[b] | bit : tx.nack[b] & ~bit;
+	tx.acked[b]++;
+	pthread_cond_broadcast(&tx.cond);
+	pthread_mutex_unlock(&tx.lock);
+	return 1;
+}
+
+int
+tx_query(
+		int b,
+		const char * cmd)
+{
+	int l = strlen(cmd), res = -1;
+	pthread_mutex_lock(&tx.lock);
+	/* the burst writes without the lock, the flag keeps us out of it */
+	if (!tx.busy[b])
+		res = write(bridge[b].serial.fd, cmd, l) == l ? 0 : -1;
+	pthread_mutex_unlock(&tx.lock);
+	return res;
+}
+
+/* ms to wait for the acknowledgement of 'm', once the firmware has it */
+static unsigned
+tx_ack_timeout(
+		msg_p m)
+{
+	unsigned repeats = m->repeats ? m->repeats : 3;	// firmware default
+	uint64_t ticks = 0;
+
+	if (m->pulses) {
+		for (unsigned i = 0; i < m->bytecount; i++)
+			ticks += m->msg[i];
+	} else {
+		/* a pulse_duration per bit, the sync, and the long low at the end */
+		unsigned d = m->pulse_duration ? m->pulse_duration : 0x63;
+		ticks = ((uint64_t)m->bitcount + 1) * d + FW_MAX_TICKS;
+	}
+	unsigned ms = ((ticks * FW_TICK_NS) / 1000000) + 1;
+	return TX_ACK_TIMEOUT_MS + TX_LBT_MAX_MS + (repeats * (ms + m->gap));
+}
+
+/* absolute time 'ms' from now, for pthread_cond_timedwait() */
+static void
+tx_deadline(
+		struct timespec * ts,
+		unsigned ms)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/*
+ * wait at most 'timeout' ms for the acknowledgement of frame 'done' by
+ * bridge 'b', return 1 if it was sent, 0 if the firmware returned an
+ * error, -1 on timeout
+ */
+static int
+tx_wait_ack(
+		int b,
+		unsigned done,
+		unsigned timeout)
+{
+	struct timespec ts;
+	tx_deadline(&ts, timeout);
+	int res = 1;
+	pthread_mutex_lock(&tx.lock);
+	while (tx.acked[b] <= done && res > 0)
+		if (pthread_cond_timedwait(&tx.cond, &tx.lock, &ts) == ETIMEDOUT)
+			res = -1;
+	if (tx.acked[b] > done)
+		res = !(tx.nack[b] & (1 << (done & 31)));
+	pthread_mutex_unlock(&tx.lock);
+	return res;
+}
+
+/*
+ * After a timeout we can't tell which frame the next acknowledgement is
+ * for. The firmware handles the lines in order, and FLOW only gets a
+ * "*F" reply, so once that is in, every frame sent before it has been
+ * acknowledged, or never will be. Firmwares without FLOW get drained
+ * instead, until the 'sent' acknowledgements are in, or none came for a
+ * timeout. 'timeout' is the ms the frames still in the firmware can take.
+ * Returns the number of acknowledgements, -1 if the firmware didn't
+ * reply, the bridge is then resynced before the next burst.
+ */
+static int
+tx_resync(
+		int b,
+		int fd,
+		unsigned sent,
+		unsigned timeout)
+{
+	struct timespec ts;
+	int res = 0;
+
+	pthread_mutex_lock(&tx.lock);
+	if (bridge[b].serial.flow) {
+		unsigned f = tx.flows[b];
+		pthread_mutex_unlock(&tx.lock);
+		if (write(fd, "FLOW\n", 5) != 5)
+			res = -1;
+		tx_deadline(&ts, timeout);
+		pthread_mutex_lock(&tx.lock);
+		while (!res && tx.flows[b] == f)
+			if (pthread_cond_timedwait(&tx.cond, &tx.lock, &ts) == ETIMEDOUT)
+				res = -1;
+	} else {
+		unsigned a = tx.acked[b];
+		tx_deadline(&ts, timeout);
+		while (tx.acked[b] < sent) {
+			if (pthread_cond_timedwait(&tx.cond, &tx.lock, &ts) != ETIMEDOUT)
+				continue;
+			if (tx.acked[b] == a)
+				break;
+			a = tx.acked[b];
+			tx_deadline(&ts, timeout);
+		}
+	}
+	tx.lost[b] = res < 0;
+	if (!res)
+		res = tx.acked[b];
+	pthread_mutex_unlock(&tx.lock);
+	return res;
+}
+
+/* is there an interactive job waiting? */
+static int
+tx_preempt(
+		tx_job_p j)
+{
+	if (j->cls == tx_Interactive)
+		return 0;
+	pthread_mutex_lock(&tx.lock);
+	int res = tx.head[tx_Interactive] != NULL;
+	pthread_mutex_unlock(&tx.lock);
+	return res;
+}
+
+/*
+ * Send frames 'first' to 'first + count' of 'j' to bridge 'b'. Stops
+ * early at a frame boundary if the job is preempted. Returns the number
+ * of frames done, 'failed' flags the ones that were not acknowledged.
+ */
+static int
+tx_burst(
+		tx_job_p j,
+		int b,
+		int first,
+		unsigned count,
+		uint8_t * failed)
+{
+	const char * path = bridge[b].path;
+	int fd = open(path, O_WRONLY | O_NOCTTY);
+	if (fd < 0) {
+		log_printf(log_Error, "%s: %s\n", path, strerror(errno));
+		memset(failed, 1, count);
+		return count;
+	}
+	pthread_mutex_lock(&tx.lock);
+	tx.busy[b] = 1;
+	int lost = tx.lost[b];
+	pthread_mutex_unlock(&tx.lock);
+
+	int preempted = 0;
+	unsigned sent = 0, done = 0;
+	/* a previous burst couldn't tell what it's late acks were for */
+	if (lost && tx_resync(b, fd, 0, TX_ACK_TIMEOUT_MS) < 0) {
+		log_printf(log_Warn, "TX: %s is not answering\n", path);
+		memset(failed, 1, count);
+		done = count;
+		goto out;
+	}
+	pthread_mutex_lock(&tx.lock);
+	tx.acked[b] = tx.nack[b] = tx.deferred[b] = 0;
+	pthread_mutex_unlock(&tx.lock);
+
+	msg_p * frame = j->frame + first;
+	/* the worst is a packed 'P', with 10 bits per phase */
+	char line[32 + ((MSG_MAX_BYTES * 10) / 8) * 2];
+	/* bytes waiting in the firmware FIFO, the oldest frame isn't */
+	unsigned fifo = bridge[b].serial.rx_fifo - 1, queued = 0;
+	unsigned size[TX_WINDOW], timeout[TX_WINDOW];
+	while (done < count) {
+		/* stop feeding at a frame boundary if someone is waiting */
+		if (!preempted && done && tx_preempt(j))
+			preempted = 1;
+		/* send the next frame(s), if there is room in the firmware FIFO */
+		while (!preempted && sent < count && sent - done < TX_WINDOW) {
+			int l = msg_sprint_tx(line, sizeof(line), frame[sent]);
+			if (sent != done && queued + l > fifo)
+				break;
+			if (write(fd, line, l) != l)
+				log_printf(log_Error, "%s: %s\n", path, strerror(errno));
+			log_msg(log_Info, frame[sent], "SEND");
+			size[sent % TX_WINDOW] = l;
+			timeout[sent % TX_WINDOW] = tx_ack_timeout(frame[sent]);
+			if (sent != done)
+				queued += l;
+			sent++;
+		}
+		if (done == sent)
+			break;
+		int r = tx_wait_ack(b, done, timeout[done % TX_WINDOW]);
+		if (r == 0) {
+			log_printf(log_Warn, "TX: %s refused a frame\n", path);
+			failed[done] = 1;
+		} else if (r < 0) {
+			log_printf(log_Warn, "TX: %s did not acknowledge\n", path);
+			/* the ones after it could all still be going out */
+			unsigned wait = TX_ACK_TIMEOUT_MS;
+			for (unsigned i = done + 1; i < sent; i++)
+				wait += timeout[i % TX_WINDOW];
+			int n = tx_resync(b, fd, sent, wait);
+			/*
+			 * If some never got an acknowledgement, take it it's the
+			 * oldest ones, the later ones are all in order
+			 */
+			unsigned missing = n < 0 ? sent - done :
+					n < sent ? sent - n : 0;
+			pthread_mutex_lock(&tx.lock);
+			for (unsigned i = done; i < sent; i++)
+				failed[i] = i < done + missing ||
+						(tx.nack[b] & (1 << ((i - missing) & 31)));
+			pthread_mutex_unlock(&tx.lock);
+			done = sent;
+			queued = 0;
+			/* the next burst starts with it, anything else gets mixed up */
+			if (n < 0)
+				break;
+			continue;
+		}
+		done++;
+		/* the firmware is done reading that one, it's the one sent now */
+		if (done < sent)
+			queued -= size[done % TX_WINDOW];
+	}
+out:
+	pthread_mutex_lock(&tx.lock);
+	unsigned deferred = tx.deferred[b];
+	tx.busy[b] = 0;
+	pthread_mutex_unlock(&tx.lock);
+	j->deferred += deferred;
+	if (deferred)
+		log_printf(log_Info, "TX deferred %ums by listen before talk\n",
+				deferred);
+	close(fd);
+	return done;
+}
+
+/*
+ * Send the (remaining) frames of 'j'. Consecutive frames that go to the
+ * same bridge are sent as one burst; frames that were not acknowledged
+ * are retried on the next best bridges, if any.
+ * Returns 1 if the job was preempted by an interactive one, in which case
+ * j->sent tells where to restart.
+ */
+static int
+tx_run(
+		tx_job_p j)
+{
+	uint64_t now = gettime_ms();
+	int order[BRIDGE_MAX], o[BRIDGE_MAX];
+	int progress = 0;
+
+	if (!j->started)
+		j->started = now;
+	while (j->sent < j->count) {
+		if (progress && tx_preempt(j))
+			return 1;
+		match_route(j->frame[j->sent], order, now);
+		int count = 1;
+		while (j->sent + count < j->count) {
+			match_route(j->frame[j->sent + count], o, now);
+			if (o[0] != order[0])
+				break;
+			count++;
+		}
+		uint8_t failed[count];
+		memset(failed, 0, count);
+		int done = tx_burst(j, order[0], j->sent, count, failed);
+
+		for (int i = 0; i < done; i++) {
+			if (!failed[i])
+				continue;
+			int n = match_route(j->frame[j->sent + i], o, now);
+			for (int r = 1; r < n && failed[i]; r++) {
+				log_printf(log_Warn, "TX: failover to %s\n", bridge[o[r]].path);
+				failed[i] = 0;
+				tx_burst(j, o[r], j->sent + i, 1, &failed[i]);
+			}
+			if (failed[i])
+				j->errors++;
+		}
+		j->sent += done;
+		progress = 1;
+	}
+	return 0;
+}
+
+/*
+ * Get the next job, interactive ones first. Stale bulk jobs are returned
+ * too, flagged as dropped, so their completion is still reported.
+ */
+static tx_job_p
+tx_next(
+		uint64_t now)
+{
+	for (int c = 0; c < tx_ClassCount; c++) {
+		tx_job_p j = tx.head[c];
+		if (!j)
+			continue;
+		tx.head[c] = j->next;
+		if (!tx.head[c])
+			tx.tail[c] = NULL;
+		if (c == tx_Bulk && !j->started &&
+				now - j->queued > TX_BULK_DEADLINE_MS) {
+			j->dropped = 1;
+			j->errors = j->count;
+			tx.stats[c].dropped++;
+		}
+		return j;
+	}
+	return NULL;
+}
+
+static void
+tx_account(
+		tx_job_p j,
+		uint64_t now)
+{
+	tx_stats_t * st = &tx.stats[j->cls];
+	unsigned wait = j->started - j->queued;
+	unsigned run = now - j->queued;
+
+	st->jobs++;
+	st->frames += j->count;
+	st->wait_total += wait;
+	if (wait > st->wait_max)
+		st->wait_max = wait;
+	st->run_total += run;
+	if (run > st->run_max)
+		st->run_max = run;
+}
+
+static void *
+tx_thread(
+		void * param)
+{
+	pthread_mutex_lock(&tx.lock);
+	while (tx.running) {
+		tx_job_p j = tx_next(gettime_ms());
+		if (!j) {
+			pthread_cond_wait(&tx.cond, &tx.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&tx.lock);
+
+		if (j->dropped) {
+			log_printf(log_Warn, "TX: dropped stale bulk job %s\n",
+					j->done_topic ? j->done_topic : "");
+		} else if (tx_run(j)) {
+			/* preempted, goes back at the head of it's queue */
+			pthread_mutex_lock(&tx.lock);
+			tx.stats[j->cls].preempted++;
+			j->next = tx.head[j->cls];
+			tx.head[j->cls] = j;
+			if (!tx.tail[j->cls])
+				tx.tail[j->cls] = j;
+			continue;	// with the lock held
+		}
+		uint64_t now = gettime_ms();
+		pthread_mutex_lock(&tx.lock);
+		if (!j->dropped)
+			tx_account(j, now);
+		pthread_mutex_unlock(&tx.lock);
+		if (tx_done)
+			tx_done(j, now);
+		free(j);
+		pthread_mutex_lock(&tx.lock);
+	}
+	pthread_mutex_unlock(&tx.lock);
+	return NULL;
+}
+
+int
+tx_start()
+{
+	tx.running = 1;
+	if (pthread_create(&tx.thread, NULL, tx_thread, NULL)) {
+		tx.running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+void
+tx_stop()
+{
+	if (!tx.running)
+		return;
+	pthread_mutex_lock(&tx.lock);
+	tx.running = 0;
+	pthread_cond_broadcast(&tx.cond);
+	pthread_mutex_unlock(&tx.lock);
+	pthread_join(tx.thread, NULL);
+}
@@ -0,0 +1,103 @@
+/*
+ * tx.h
+ *
+ *  Created on: 17 Oct 2026
+ */
+
+#ifndef _TX_H_
+#define _TX_H_
+
+#include <stdint.h>
+#include "msg.h"
+#include "bridge.h"
+
+/*
+ * Priority classes; interactive jobs (someone pressed a button) preempt
+ * bulk ones (automation, retained messages replayed by the broker) at
+ * frame boundaries, and stale bulk jobs are dropped.
+ */
+enum {
+	tx_Interactive = 0,
+	tx_Bulk,
+	tx_ClassCount,
+};
+
+/* bulk jobs that waited more than that in the queue are dropped */
+#define TX_BULK_DEADLINE_MS		30000
+
+/*
+ * A transmit job is a list of frames that are sent back to back to the
+ * bridge; a single switch command, or a whole scene.
+ */
+typedef struct tx_job_t {
+	struct tx_job_t *	next;
+	const char *		done_topic;	// for the completion callback
+	uint64_t			queued;		// gettime_ms() when queued
+	uint64_t			started;	// when the first frame was sent
+	uint8_t				cls;		// tx_Interactive, tx_Bulk
+	uint8_t				dropped;	// expired before it could be sent
+	int					errors;		// frames not acknowledged
+	unsigned			deferred;	// ms the firmware waited for a clear channel
+	int					sent;		// progress, in case we are preempted
+	int					count;
+	msg_p				frame[];
+} tx_job_t, *tx_job_p;
+
+/* per class latency metrics */
+typedef struct tx_stats_t {
+	unsigned			jobs, frames;
+	unsigned			dropped, preempted;
+	uint64_t			wait_total;	// ms between queued and started
+	unsigned			wait_max;
+	uint64_t			run_total;	// ms between queued and done
+	unsigned			run_max;
+} tx_stats_t;
+
+/* called from the TX thread when a job is done, before it is freed */
+extern void (*tx_done)(
+		tx_job_p j,
+		uint64_t now);
+
+tx_job_p
+tx_job_new(
+		int count,
+		const char * done_topic);
+
+/* start the transmit thread, writing to the bridges in bridge[] */
+int
+tx_start();
+
+void
+tx_stop();
+
+/* queue 'j' in it's class, the TX thread will free it */
+void
+tx_queue(
+		tx_job_p j);
+
+/* copy the current stats for class 'cls' */
+void
+tx_get_stats(
+		int cls,
+		tx_stats_t * dst);
+
+/*
+ * Called by the serial reader of bridge 'b' with every line that is not a
+ * message, we pick up the firmware acknowledgements ("*OK" or "!<error>")
+ */
+int
+tx_ack(
+		int b,
+		const char * line);
+
+/*
+ * Send command 'cmd' that only gets a reply (no "*OK") to bridge 'b', so
+ * it doesn't mix with a burst's frames and acknowledgements. Returns -1
+ * if a burst is going on there, try again later.
+ */
+int
+tx_query(
+		int b,
+		const char * cmd);
+
+#endif /* _TX_H_ */
@@ -9,6 +9,8 @@
 #define _UTILS_H_
 
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
 
 typedef struct fileio_t {
 	FILE *f;
@@ -16,4 +18,18 @@ typedef struct fileio_t {
 	const char *fname;
 } fileio_t, *fileio_p;
 
+static inline uint64_t gettime_ms()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (((uint64_t)tv.tv_sec) * 1000) + (tv.tv_usec / 1000);
+}
+
+static inline uint64_t gettime_us()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (((uint64_t)tv.tv_sec) * 1000000) + tv.tv_usec;
+}
+
 #endif /* _UTILS_H_ */